@@ -0,0 +1,559 @@
+// Stack benchmark: two stacks in one process joined by a memory link,
+// optionally impaired with delay, jitter, loss, reordering and a bandwidth
+// limit. Measures bulk throughput, request/response latency percentiles
+// and connections per second, prints a summary and appends the results to
+// a JSON Lines file so runs can be compared across commits. Every draw is
+// seeded, so a run can be repeated. Exits non-zero if a test fails or the
+// bulk data arrives corrupted.
+//
+// Usage: ./tcp_bench [options] (--help lists them)
+
+#include "tcp_lite.h"
+#include "tcp_backend.h"
+#include "tcp_clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define BENCH_PORT     5001
+#define BENCH_TIMEOUT  120          // Seconds a test may take before it is abandoned
+#define BULK_PATTERN   (1 << 20)    // Bytes of random data the bulk test repeats
+#define RR_WARMUP      100          // Transactions run before latency is recorded
+
+struct options {
+    const char *tests;
+    const char *label;
+    const char *json;
+    size_t bulk_bytes;
+    int requests;
+    int size;
+    int connections;
+    int mtu;
+    tcp_netem_t netem;
+};
+
+struct bench {
+    tcp_stack_t *client;
+    tcp_stack_t *server;
+    int listener;
+    struct sockaddr_in addr;          // Where the listener is
+    double deadline;                  // When the running test is abandoned
+};
+
+struct results {
+    int bulk_done, rr_done, crr_done;
+    double bulk_seconds, bulk_mbps;
+    int bulk_ok;
+    uint32_t bulk_retrans, bulk_timeouts;
+    double rr_mean, rr_p50, rr_p99, rr_p999, rr_rate;
+    double crr_seconds, crr_rate, crr_mean;
+};
+
+static FILE *out;                     // Report; stdout carries the stack's log
+
+static double now_sec(void) {
+    return tcp_now_ns() / 1e9;
+}
+
+static int timed_out(struct bench *b, const char *what) {
+    if (now_sec() < b->deadline) {
+        return 0;
+    }
+    fprintf(stderr, "%s: no progress after %d s\n", what, BENCH_TIMEOUT);
+    return 1;
+}
+
+static int set_nonblock(int fd) {
+    return tcp_fcntl(fd, F_SETFL, O_NONBLOCK);
+}
+
+// Open a connection from the client stack and accept it on the server
+static int bench_connect(struct bench *b, int *cfd, int *sfd) {
+    *cfd = tcp_stack_socket(b->client);
+    if (*cfd < 0) {
+        perror("tcp_stack_socket");
+        return -1;
+    }
+    if (tcp_connect(*cfd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0) {
+        perror("tcp_connect");
+        return -1;
+    }
+    
+    while ((*sfd = tcp_accept(b->listener, NULL, NULL)) < 0) {
+        if (errno != EAGAIN) {
+            perror("tcp_accept");
+            return -1;
+        }
+        tcp_stack_poll(b->client, 0);
+        if (timed_out(b, "accept")) {
+            return -1;
+        }
+    }
+    
+    if (set_nonblock(*cfd) < 0 || set_nonblock(*sfd) < 0) {
+        perror("tcp_fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+// Move len bytes from one end of a connection to the other. Both sides
+// are non-blocking, so every call gives the stacks a turn.
+static int transfer(struct bench *b, int from, int to, const uint8_t *data, uint8_t *buf, size_t len) {
+    size_t sent = 0, got = 0;
+    
+    while (got < len) {
+        if (sent < len) {
+            ssize_t n = tcp_send(from, data + sent, len - sent, 0);
+            if (n > 0) {
+                sent += n;
+            } else if (errno != EAGAIN) {
+                perror("tcp_send");
+                return -1;
+            }
+        }
+        
+        ssize_t n = tcp_recv(to, buf + got, len - got, 0);
+        if (n > 0) {
+            got += n;
+        } else if (n == 0 || errno != EAGAIN) {
+            fprintf(stderr, "tcp_recv: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+            return -1;
+        } else if (timed_out(b, "transfer")) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read until the peer's FIN
+static int wait_eof(struct bench *b, int fd) {
+    uint8_t buf[256];
+    
+    while (1) {
+        ssize_t n = tcp_recv(fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0 && errno != EAGAIN) {
+            perror("tcp_recv");
+            return -1;
+        }
+        if (timed_out(b, "close")) {
+            return -1;
+        }
+    }
+}
+
+// One connection streams bulk_bytes to the other side, which checks every
+// byte against the pattern
+static int run_bulk(struct bench *b, const struct options *o, struct results *r) {
+    uint8_t *pattern = malloc(2 * BULK_PATTERN);
+    uint8_t *buf = malloc(65536);
+    if (pattern == NULL || buf == NULL) {
+        free(pattern);
+        free(buf);
+        return -1;
+    }
+    
+    // Two copies back to back so any window of the stream is contiguous
+    srand(o->netem.seed);
+    for (size_t i = 0; i < BULK_PATTERN; i++) {
+        pattern[i] = pattern[BULK_PATTERN + i] = rand();
+    }
+    
+    int cfd, sfd;
+    b->deadline = now_sec() + BENCH_TIMEOUT;
+    if (bench_connect(b, &cfd, &sfd) < 0) {
+        free(pattern);
+        free(buf);
+        return -1;
+    }
+    
+    size_t sent = 0, got = 0;
+    int ok = 1;
+    double start = now_sec();
+    while (got < o->bulk_bytes) {
+        if (sent < o->bulk_bytes) {
+            size_t n = o->bulk_bytes - sent < BULK_PATTERN ? o->bulk_bytes - sent : BULK_PATTERN;
+            ssize_t ret = tcp_send(cfd, pattern + sent % BULK_PATTERN, n, 0);
+            if (ret > 0) {
+                sent += ret;
+            } else if (errno != EAGAIN) {
+                perror("tcp_send");
+                break;
+            }
+        }
+        
+        ssize_t n = tcp_recv(sfd, buf, 65536, 0);
+        if (n > 0) {
+            if (memcmp(buf, pattern + got % BULK_PATTERN, n) != 0) {
+                ok = 0;
+            }
+            got += n;
+            b->deadline = now_sec() + BENCH_TIMEOUT;
+        } else if (n == 0 || errno != EAGAIN) {
+            fprintf(stderr, "tcp_recv: %s\n", n == 0 ? "unexpected EOF" : strerror(errno));
+            break;
+        } else if (timed_out(b, "bulk")) {
+            break;
+        }
+    }
+    double elapsed = now_sec() - start;
+    
+    tcp_conn_info_t info;
+    if (tcp_getinfo(cfd, &info) == 0) {
+        r->bulk_retrans = info.retrans_segs;
+        r->bulk_timeouts = info.timeouts;
+    }
+    tcp_close(cfd);
+    tcp_close(sfd);
+    free(pattern);
+    free(buf);
+    if (got < o->bulk_bytes) {
+        return -1;
+    }
+    
+    r->bulk_done = 1;
+    r->bulk_seconds = elapsed;
+    r->bulk_mbps = got / elapsed / 1e6;
+    r->bulk_ok = ok;
+    return ok ? 0 : -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Smallest sample at or above fraction p of the sorted samples
+static double percentile(const double *sorted, int n, double p) {
+    int i = (int)(p * n + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i >= n ? n - 1 : i];
+}
+
+// Ping-pong of size-byte requests and responses on one connection
+static int run_rr(struct bench *b, const struct options *o, struct results *r) {
+    uint8_t *req = calloc(1, o->size);
+    uint8_t *buf = malloc(o->size);
+    double *lat = malloc(o->requests * sizeof(double));
+    int cfd, sfd, ret = -1;
+    
+    b->deadline = now_sec() + BENCH_TIMEOUT;
+    if (req == NULL || buf == NULL || lat == NULL || bench_connect(b, &cfd, &sfd) < 0) {
+        goto out;
+    }
+    tcp_setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    tcp_setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    
+    double sum = 0, start = 0;
+    for (int i = -RR_WARMUP; i < o->requests; i++) {
+        if (i == 0) {
+            start = now_sec();
+        }
+        double t = now_sec();
+        b->deadline = t + BENCH_TIMEOUT;
+        if (transfer(b, cfd, sfd, req, buf, o->size) < 0 ||
+            transfer(b, sfd, cfd, buf, req, o->size) < 0) {
+            goto close;
+        }
+        if (i >= 0) {
+            lat[i] = (now_sec() - t) * 1e6;
+            sum += lat[i];
+        }
+    }
+    double elapsed = now_sec() - start;
+    
+    qsort(lat, o->requests, sizeof(double), cmp_double);
+    r->rr_done = 1;
+    r->rr_mean = sum / o->requests;
+    r->rr_p50 = percentile(lat, o->requests, 0.50);
+    r->rr_p99 = percentile(lat, o->requests, 0.99);
+    r->rr_p999 = percentile(lat, o->requests, 0.999);
+    r->rr_rate = o->requests / elapsed;
+    ret = 0;
+    
+close:
+    tcp_close(cfd);
+    tcp_close(sfd);
+out:
+    free(req);
+    free(buf);
+    free(lat);
+    return ret;
+}
+
+// Connect, exchange one request and response, and close, over and over.
+// The client closes first and leaves its side in TIME_WAIT.
+static int run_crr(struct bench *b, const struct options *o, struct results *r) {
+    uint8_t *req = calloc(1, o->size);
+    uint8_t *buf = malloc(o->size);
+    int ret = -1;
+    if (req == NULL || buf == NULL) {
+        goto out;
+    }
+    
+    double start = now_sec();
+    for (int i = 0; i < o->connections; i++) {
+        int cfd, sfd;
+        b->deadline = now_sec() + BENCH_TIMEOUT;
+        if (bench_connect(b, &cfd, &sfd) < 0) {
+            goto out;
+        }
+        if (transfer(b, cfd, sfd, req, buf, o->size) < 0 ||
+            transfer(b, sfd, cfd, buf, req, o->size) < 0 ||
+            tcp_close(cfd) < 0 || wait_eof(b, sfd) < 0 || tcp_close(sfd) < 0) {
+            goto out;
+        }
+    }
+    double elapsed = now_sec() - start;
+    
+    r->crr_done = 1;
+    r->crr_seconds = elapsed;
+    r->crr_rate = o->connections / elapsed;
+    r->crr_mean = elapsed / o->connections * 1e6;
+    ret = 0;
+    
+out:
+    free(req);
+    free(buf);
+    return ret;
+}
+
+static int bench_setup(struct bench *b, const struct options *o) {
+    tcp_stack_config_t client = {
+        .backend = &tcp_backend_mem, .addr = inet_addr("10.77.0.1"), .mtu = o->mtu,
+    };
+    tcp_stack_config_t server = {
+        .backend = &tcp_backend_mem, .addr = inet_addr("10.77.0.2"), .mtu = o->mtu,
+    };
+    
+    b->client = tcp_stack_create(&client);
+    b->server = tcp_stack_create(&server);
+    if (b->client == NULL || b->server == NULL || tcp_mem_link(b->client, b->server) < 0) {
+        perror("memory link");
+        return -1;
+    }
+    
+    // Impair both directions alike, each with its own draws
+    tcp_netem_t netem = o->netem;
+    if (tcp_mem_netem(b->client, &netem) < 0) {
+        perror("tcp_mem_netem");
+        return -1;
+    }
+    netem.seed++;
+    tcp_mem_netem(b->server, &netem);
+    
+    memset(&b->addr, 0, sizeof(b->addr));
+    b->addr.sin_family = AF_INET;
+    b->addr.sin_port = htons(BENCH_PORT);
+    b->addr.sin_addr.s_addr = server.addr;
+    
+    b->listener = tcp_stack_socket(b->server);
+    if (b->listener < 0 ||
+        tcp_bind(b->listener, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0 ||
+        tcp_listen(b->listener, 128) < 0 || set_nonblock(b->listener) < 0) {
+        perror("listener");
+        return -1;
+    }
+    return 0;
+}
+
+static void print_report(const struct options *o, const struct results *r) {
+    const tcp_netem_t *ne = &o->netem;
+    
+    fprintf(out, "Link: mtu %d, delay %u us, jitter %u us, loss %g%%, reorder %g%%, rate %s",
+            o->mtu, ne->delay_us, ne->jitter_us, ne->loss * 100, ne->reorder * 100,
+            ne->rate_bps ? "" : "unlimited");
+    if (ne->rate_bps) {
+        fprintf(out, "%g Mbit/s", ne->rate_bps / 1e6);
+    }
+    fprintf(out, ", seed %u\n", ne->seed);
+    
+    if (r->bulk_done) {
+        fprintf(out, "  bulk  %8.1f MB/s   %zu bytes in %.3f s, %u retransmits, %u timeouts%s\n",
+                r->bulk_mbps, o->bulk_bytes, r->bulk_seconds, r->bulk_retrans, r->bulk_timeouts,
+                r->bulk_ok ? "" : " (CORRUPTED)");
+    }
+    if (r->rr_done) {
+        fprintf(out, "  rr    %8.0f /s     p50 %.1f us  p99 %.1f us  p999 %.1f us  mean %.1f us\n",
+                r->rr_rate, r->rr_p50, r->rr_p99, r->rr_p999, r->rr_mean);
+    }
+    if (r->crr_done) {
+        fprintf(out, "  crr   %8.0f /s     %d connections, %.1f us each\n",
+                r->crr_rate, o->connections, r->crr_mean);
+    }
+}
+
+// One JSON object per run on a line of its own
+static int write_json(const struct options *o, const struct results *r) {
+    FILE *f = fopen(o->json, "a");
+    if (f == NULL) {
+        perror(o->json);
+        return -1;
+    }
+    
+    const tcp_netem_t *ne = &o->netem;
+    fprintf(f, "{\"label\":\"%s\",\"time\":%ld,", o->label, (long)time(NULL));
+    fprintf(f, "\"link\":{\"mtu\":%d,\"delay_us\":%u,\"jitter_us\":%u,\"loss\":%g,"
+            "\"reorder\":%g,\"rate_bps\":%llu,\"seed\":%u}",
+            o->mtu, ne->delay_us, ne->jitter_us, ne->loss, ne->reorder,
+            (unsigned long long)ne->rate_bps, ne->seed);
+    if (r->bulk_done) {
+        fprintf(f, ",\"bulk\":{\"bytes\":%zu,\"seconds\":%.6f,\"mbyte_per_s\":%.2f,"
+                "\"retrans_segs\":%u,\"timeouts\":%u,\"ok\":%s}",
+                o->bulk_bytes, r->bulk_seconds, r->bulk_mbps, r->bulk_retrans, r->bulk_timeouts,
+                r->bulk_ok ? "true" : "false");
+    }
+    if (r->rr_done) {
+        fprintf(f, ",\"rr\":{\"requests\":%d,\"size\":%d,\"per_s\":%.1f,\"mean_us\":%.2f,"
+                "\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f}",
+                o->requests, o->size, r->rr_rate, r->rr_mean, r->rr_p50, r->rr_p99, r->rr_p999);
+    }
+    if (r->crr_done) {
+        fprintf(f, ",\"crr\":{\"connections\":%d,\"size\":%d,\"seconds\":%.6f,\"per_s\":%.1f}",
+                o->connections, o->size, r->crr_seconds, r->crr_rate);
+    }
+    fprintf(f, "}\n");
+    
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Whether name is an item of the comma-separated list
+static int has_test(const char *list, const char *name) {
+    size_t len = strlen(name);
+    
+    while (*list) {
+        if (strncmp(list, name, len) == 0 && (list[len] == ',' || list[len] == '\0')) {
+            return 1;
+        }
+        list += strcspn(list, ",");
+        list += *list == ',';
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --tests LIST        Comma-separated tests from bulk,rr,crr (default all)\n"
+            "  --megabytes N       Bulk transfer size (default 64)\n"
+            "  --requests N        Request/response transactions (default 10000)\n"
+            "  --size N            Request and response size in bytes (default 64)\n"
+            "  --connections N     Connections opened by the crr test (default 1000)\n"
+            "  --mtu N             Link MTU (default %d)\n"
+            "  --delay-us N        One-way delay of the link\n"
+            "  --jitter-us N       Extra random delay, reorders packets\n"
+            "  --loss PCT          Percentage of packets dropped in each direction\n"
+            "  --reorder PCT       Percentage of packets that skip the delay\n"
+            "  --rate-mbit N       Link bandwidth in Mbit/s (default unlimited)\n"
+            "  --seed N            Seed of the data and the link's draws (default 1)\n"
+            "  --label TEXT        Name of the run in the JSON output, e.g. a commit\n"
+            "  --json FILE         Append the results to FILE as one JSON line\n",
+            prog, TCP_MTU_DEFAULT);
+}
+
+int main(int argc, char *argv[]) {
+    struct options o = {
+        .tests = "bulk,rr,crr",
+        .label = "",
+        .bulk_bytes = 64 << 20,
+        .requests = 10000,
+        .size = 64,
+        .connections = 1000,
+        .mtu = TCP_MTU_DEFAULT,
+        .netem = { .seed = 1 },
+    };
+    
+    static const struct option longopts[] = {
+        { "tests", required_argument, NULL, 't' },
+        { "megabytes", required_argument, NULL, 'm' },
+        { "requests", required_argument, NULL, 'n' },
+        { "size", required_argument, NULL, 's' },
+        { "connections", required_argument, NULL, 'c' },
+        { "mtu", required_argument, NULL, 'M' },
+        { "delay-us", required_argument, NULL, 'd' },
+        { "jitter-us", required_argument, NULL, 'j' },
+        { "loss", required_argument, NULL, 'l' },
+        { "reorder", required_argument, NULL, 'r' },
+        { "rate-mbit", required_argument, NULL, 'R' },
+        { "seed", required_argument, NULL, 'S' },
+        { "label", required_argument, NULL, 'L' },
+        { "json", required_argument, NULL, 'J' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 't': o.tests = optarg; break;
+        case 'm': o.bulk_bytes = strtoull(optarg, NULL, 0) << 20; break;
+        case 'n': o.requests = atoi(optarg); break;
+        case 's': o.size = atoi(optarg); break;
+        case 'c': o.connections = atoi(optarg); break;
+        case 'M': o.mtu = atoi(optarg); break;
+        case 'd': o.netem.delay_us = strtoul(optarg, NULL, 0); break;
+        case 'j': o.netem.jitter_us = strtoul(optarg, NULL, 0); break;
+        case 'l': o.netem.loss = atof(optarg) / 100; break;
+        case 'r': o.netem.reorder = atof(optarg) / 100; break;
+        case 'R': o.netem.rate_bps = (uint64_t)(atof(optarg) * 1e6); break;
+        case 'S': o.netem.seed = strtoul(optarg, NULL, 0); break;
+        case 'L': o.label = optarg; break;
+        case 'J': o.json = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (o.bulk_bytes == 0 || o.requests <= 0 || o.size <= 0 || o.connections <= 0 ||
+        o.mtu < 576 || o.netem.loss < 0 || o.netem.loss > 1 ||
+        o.netem.reorder < 0 || o.netem.reorder > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    // The stack narrates every handshake and close on stdout; keep that
+    // out of the report and out of the timings
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 1;
+    }
+    
+    struct bench b;
+    struct results r = { 0 };
+    if (bench_setup(&b, &o) < 0) {
+        return 1;
+    }
+    
+    int failed = 0;
+    if (has_test(o.tests, "bulk") && run_bulk(&b, &o, &r) < 0) {
+        fprintf(stderr, "bulk test failed\n");
+        failed = 1;
+    }
+    if (has_test(o.tests, "rr") && run_rr(&b, &o, &r) < 0) {
+        fprintf(stderr, "rr test failed\n");
+        failed = 1;
+    }
+    if (has_test(o.tests, "crr") && run_crr(&b, &o, &r) < 0) {
+        fprintf(stderr, "crr test failed\n");
+        failed = 1;
+    }
+    
+    tcp_stack_destroy(b.client);
+    tcp_stack_destroy(b.server);
+    
+    print_report(&o, &r);
+    if (o.json && write_json(&o, &r) < 0) {
+        failed = 1;
+    }
+    fclose(out);
+    return failed;
+}
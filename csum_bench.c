@@ -0,0 +1,172 @@
+// Checksum kernel check and micro-benchmark: verifies every kernel the CPU
+// supports against the original 16-bit reference, then reports throughput
+// per kernel and buffer size. Exits non-zero on any mismatch.
+//
+// Usage: ./csum_bench [megabytes per measurement]
+
+#include "tcp_csum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LEN   65536
+#define MAX_SHIFT 64
+
+// The original tcp_checksum(): 16-bit words into a 32-bit sum
+static uint16_t ref_checksum(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint32_t sum = 0;
+    
+    while (len > 1) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        sum += w;
+        p += 2;
+        len -= 2;
+    }
+    
+    if (len == 1) {
+        sum += *p;
+    }
+    
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    
+    return ~sum;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compare one kernel with the reference on every length up to 2 KB at
+// every alignment, on large buffers, on all-ones data (maximal carries)
+// and on chained sums. Returns the number of mismatches.
+static int check_impl(const tcp_csum_impl_t *impl, uint8_t *buf) {
+    int errors = 0;
+    
+    for (size_t shift = 0; shift < MAX_SHIFT; shift++) {
+        for (size_t len = 0; len <= 2048; len++) {
+            const uint8_t *p = buf + shift;
+            if (tcp_csum_fold(impl->partial(p, len, 0)) != ref_checksum(p, len)) {
+                if (errors++ < 5) {
+                    printf("  MISMATCH %s: len %zu shift %zu\n", impl->name, len, shift);
+                }
+            }
+        }
+    }
+    
+    size_t big[] = { 4095, 9000, 32767, MAX_LEN };
+    for (size_t i = 0; i < sizeof(big) / sizeof(big[0]); i++) {
+        if (tcp_csum_fold(impl->partial(buf + 1, big[i], 0)) != ref_checksum(buf + 1, big[i])) {
+            printf("  MISMATCH %s: len %zu\n", impl->name, big[i]);
+            errors++;
+        }
+    }
+    
+    static uint8_t ones[MAX_LEN];
+    memset(ones, 0xFF, sizeof(ones));
+    for (size_t len = MAX_LEN - 70; len <= MAX_LEN; len++) {
+        if (tcp_csum_fold(impl->partial(ones, len, 0)) != ref_checksum(ones, len)) {
+            printf("  MISMATCH %s: all-ones len %zu\n", impl->name, len);
+            errors++;
+        }
+    }
+    
+    // A sum split at any even offset must equal the one-shot sum
+    for (size_t split = 0; split <= 1500; split += 2) {
+        uint32_t sum = impl->partial(buf, split, 0);
+        sum = impl->partial(buf + split, 1500 - split, sum);
+        if (tcp_csum_fold(sum) != ref_checksum(buf, 1500)) {
+            printf("  MISMATCH %s: chained split %zu\n", impl->name, split);
+            errors++;
+        }
+    }
+    
+    return errors;
+}
+
+int main(int argc, char *argv[]) {
+    double mb = argc > 1 ? atof(argv[1]) : 256;
+    if (mb <= 0) {
+        mb = 256;
+    }
+    
+    uint8_t *buf = malloc(MAX_LEN + MAX_SHIFT);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < MAX_LEN + MAX_SHIFT; i++) {
+        buf[i] = rand();
+    }
+    
+    tcp_csum_init();
+    printf("Active kernel: %s\n\n", tcp_csum_active()->name);
+    
+    // Correctness
+    int failed = 0;
+    for (size_t i = 0; i < tcp_csum_impl_count; i++) {
+        const tcp_csum_impl_t *impl = tcp_csum_impls[i];
+        if (!impl->supported()) {
+            printf("%-10s skipped (not supported by this CPU)\n", impl->name);
+            continue;
+        }
+        int errors = check_impl(impl, buf);
+        printf("%-10s %s\n", impl->name, errors ? "FAILED" : "ok");
+        failed += errors;
+    }
+    if (failed) {
+        printf("\n%d mismatches against the reference checksum\n", failed);
+        return 1;
+    }
+    
+    // Throughput
+    size_t sizes[] = { 20, 40, 576, 1460, 9000, MAX_LEN };
+    printf("\n%-10s", "bytes");
+    printf(" %12s", "reference");
+    for (size_t i = 0; i < tcp_csum_impl_count; i++) {
+        printf(" %12s", tcp_csum_impls[i]->name);
+    }
+    printf("   (GB/s)\n");
+    
+    volatile uint32_t sink = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        long iters = (long)(mb * 1e6 / len);
+        if (iters < 1) {
+            iters = 1;
+        }
+        
+        printf("%-10zu", len);
+        
+        double t0 = now_sec();
+        for (long n = 0; n < iters; n++) {
+            sink += ref_checksum(buf, len);
+        }
+        printf(" %12.2f", (double)len * iters / (now_sec() - t0) / 1e9);
+        
+        for (size_t i = 0; i < tcp_csum_impl_count; i++) {
+            const tcp_csum_impl_t *impl = tcp_csum_impls[i];
+            if (!impl->supported()) {
+                printf(" %12s", "-");
+                continue;
+            }
+            t0 = now_sec();
+            for (long n = 0; n < iters; n++) {
+                sink += impl->partial(buf, len, 0);
+            }
+            printf(" %12.2f", (double)len * iters / (now_sec() - t0) / 1e9);
+        }
+        printf("\n");
+    }
+    (void)sink;
+    
+    free(buf);
+    return 0;
+}
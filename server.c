@@ -5,6 +5,22 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 
+// Does the data in iov start with prefix? The receive ring may have
+// wrapped, splitting it between the two buffers.
+static int data_starts_with(const struct iovec *iov, int iovcnt, const char *prefix) {
+    size_t len = strlen(prefix);
+    size_t pos = 0;
+    
+    for (int i = 0; i < iovcnt && pos < len; i++) {
+        size_t n = iov[i].iov_len < len - pos ? iov[i].iov_len : len - pos;
+        if (memcmp(iov[i].iov_base, prefix + pos, n) != 0) {
+            return 0;
+        }
+        pos += n;
+    }
+    return pos == len;
+}
+
 int main(int argc, char *argv[]) {
     char *bind_ip = "0.0.0.0";  // Default: listen on all interfaces
     int port = 8080;
@@ -87,14 +103,17 @@ int main(int argc, char *argv[]) {
            inet_ntoa(client_addr.sin_addr),
            ntohs(client_addr.sin_port));
     
-    // Receive data in a loop
-    char buffer[1024];
+    // Receive data in a loop. Messages are read in place in the stack's
+    // receive buffer and echoed straight from there, without copying them
+    // into buffers of our own.
     while (1) {
         printf("Waiting for data...\n");
         
-        ssize_t received = tcp_recv(client_fd, buffer, sizeof(buffer) - 1, 0);
+        struct iovec iov[3];
+        int iovcnt;
+        ssize_t received = tcp_recv_zc(client_fd, iov + 1, &iovcnt, 0);
         if (received < 0) {
-            perror("tcp_recv failed");
+            perror("tcp_recv_zc failed");
             break;
         }
         
@@ -103,23 +122,28 @@ int main(int argc, char *argv[]) {
             break;
         }
         
-        buffer[received] = '\0';
-        printf("Received %zd bytes: %s\n", received, buffer);
+        printf("Received %zd bytes: ", received);
+        for (int i = 1; i <= iovcnt; i++) {
+            fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+        }
+        printf("\n");
         
-        // Echo back
+        // Echo back, the prefix and the message in one stream
         printf("Sending echo response...\n");
-        char response[2048];  // Larger buffer to avoid truncation
-        snprintf(response, sizeof(response), "Echo: %s", buffer);
+        iov[0].iov_base = "Echo: ";
+        iov[0].iov_len = 6;
         
-        ssize_t sent = tcp_send(client_fd, response, strlen(response), 0);
+        ssize_t sent = tcp_sendv(client_fd, iov, iovcnt + 1, 0);
+        int quit = data_starts_with(iov + 1, iovcnt, "quit");
+        tcp_recv_release(client_fd, received);
         if (sent < 0) {
-            perror("tcp_send failed");
+            perror("tcp_sendv failed");
             break;
         }
         printf("Sent %zd bytes\n\n", sent);
         
         // Exit if client sends "quit"
-        if (strncmp(buffer, "quit", 4) == 0) {
+        if (quit) {
             printf("Quit command received\n");
             break;
         }
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# TCP Lite - TUN Device Setup Script
+# This script creates the TUN device a stack with the TUN backend attaches
+# to. The kernel gets 10.77.0.1 on it; the stack uses 10.77.0.2, an address
+# the kernel's TCP does not own, so no iptables rules are needed.
+
+DEV=${1:-tl0}
+OWNER=${SUDO_USER:-root}
+
+echo "=========================================="
+echo "TCP Lite - TUN Device Setup"
+echo "=========================================="
+echo ""
+
+# Check if running as root
+if [ "$EUID" -ne 0 ]; then
+    echo "Error: This script must be run as root"
+    echo "Please run: sudo ./setup_tun.sh [device]"
+    exit 1
+fi
+
+# Remove a leftover device of the same name (if any)
+ip link del "$DEV" 2>/dev/null
+
+ip tuntap add dev "$DEV" mode tun user "$OWNER" || exit 1
+ip addr add 10.77.0.1/24 dev "$DEV"
+ip link set "$DEV" up
+echo "✓ Created $DEV (kernel side 10.77.0.1/24, owner $OWNER)"
+
+echo ""
+echo "Create the stack with:"
+echo "  tcp_stack_config_t config = { .backend = &tcp_backend_tun, .ifname = \"$DEV\","
+echo "                                .addr = inet_addr(\"10.77.0.2\") };"
+echo ""
+echo "To remove the device later, run:"
+echo "  sudo ip link del $DEV"
+echo ""
@@ -0,0 +1,872 @@
+#define _GNU_SOURCE  // sendmmsg(), recvmmsg()
+#include "tcp_backend.h"
+#include "tcp_pktbuf.h"
+#include "tcp_clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <linux/filter.h>
+
+// Wait for fd to become readable, or for an application thread to signal
+// the stack's wakeup eventfd. Returns >0 when fd is readable, 0 on
+// timeout, wakeup or interruption, -1 on error.
+static int backend_poll_fd(tcp_stack_t *stack, int fd, int timeout_ms) {
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = stack->wake_fd, .events = POLLIN },  // Ignored while -1
+    };
+    int ready = poll(pfd, 2, timeout_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return pfd[0].revents != 0;
+}
+
+// ---------------------------------------------------------------------------
+// Raw socket and TPACKET_V3 ring
+// ---------------------------------------------------------------------------
+
+struct raw_state {
+    int fd;                           // Raw socket: every packet leaves here
+    
+    // Receive batch: one pool buffer per packet, each as large as an IP datagram
+    tcp_pktbuf_t *rx_bufs[TCP_RX_BATCH];
+    struct iovec rx_iov[TCP_RX_BATCH];
+    struct mmsghdr rx_msgs[TCP_RX_BATCH];
+    
+    // Transmit batch, pointing into the stack's packets
+    struct mmsghdr tx_msgs[TCP_TX_BATCH];
+    struct sockaddr_in tx_dst[TCP_TX_BATCH];
+    
+    // TPACKET_V3 receive ring: the kernel fills blocks with frames and flips
+    // them to TP_STATUS_USER; each block goes back once its frames are
+    // delivered. ring_fd is -1 when receiving on the raw socket.
+    int ring_fd;
+    uint8_t *ring;
+    unsigned ring_block;              // Next block to read
+};
+
+// Admit only TCP to fd, whose packets start at the IP header, and on a
+// sharded stack only the flows tcp_flow_shard() gives it: the kernel runs
+// the hash, so each shard's socket sees just its own connections.
+static int raw_attach_filter(int fd, const tcp_stack_t *stack) {
+    struct sock_filter code[] = {
+        // ldb [9] (IP protocol); jeq #6
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 22),
+        // M0 = sport ^ dport, with x = IP header length
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),
+        BPF_STMT(BPF_LDX | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ST, 0),
+        // A = saddr ^ daddr ^ M0
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 12),
+        BPF_STMT(BPF_ST, 1),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 16),
+        BPF_STMT(BPF_LDX | BPF_MEM, 1),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_LDX | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        // h = A * 0x9E3779B1; h ^= h >> 16; accept if h % shards == shard
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9E3779B1),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_LDX | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)stack->shards),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)stack->shard, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    
+    // Unsharded: skip the hash and accept every TCP packet
+    if (stack->shards <= 1) {
+        code[1].jf = 1;
+        code[2] = code[sizeof(code) / sizeof(code[0]) - 2];
+        code[3] = code[sizeof(code) / sizeof(code[0]) - 1];
+        prog.len = 4;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("setsockopt SO_ATTACH_FILTER failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Set up the AF_PACKET receive ring on ifname ("" = all interfaces).
+// Returns 0 on success, -1 if the kernel or the interface cannot provide one.
+static int raw_ring_open(struct raw_state *rs, const tcp_stack_t *stack) {
+    const char *ifname = stack->ifname;
+    int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+    if (fd < 0) {
+        perror("AF_PACKET socket creation failed");
+        return -1;
+    }
+    
+    if (raw_attach_filter(fd, stack) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    int version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("setsockopt PACKET_VERSION failed");
+        close(fd);
+        return -1;
+    }
+    
+    // Frames are variable-sized in V3; tp_frame_size only has to be valid
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = TCP_RING_BLOCK_SIZE;
+    req.tp_block_nr = TCP_RING_BLOCKS;
+    req.tp_frame_size = 2048;
+    req.tp_frame_nr = TCP_RING_BLOCK_SIZE / 2048 * TCP_RING_BLOCKS;
+    req.tp_retire_blk_tov = TCP_RING_RETIRE_MS;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("setsockopt PACKET_RX_RING failed");
+        close(fd);
+        return -1;
+    }
+    
+    void *map = mmap(NULL, (size_t)TCP_RING_BLOCK_SIZE * TCP_RING_BLOCKS,
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap of the packet ring failed");
+        close(fd);
+        return -1;
+    }
+    
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    if (ifname[0] && (sll.sll_ifindex = if_nametoindex(ifname)) == 0) {
+        fprintf(stderr, "Unknown interface %s\n", ifname);
+        munmap(map, (size_t)TCP_RING_BLOCK_SIZE * TCP_RING_BLOCKS);
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+        perror("bind of the packet socket failed");
+        munmap(map, (size_t)TCP_RING_BLOCK_SIZE * TCP_RING_BLOCKS);
+        close(fd);
+        return -1;
+    }
+    
+    printf("Receiving through a TPACKET_V3 ring on %s\n", ifname[0] ? ifname : "all interfaces");
+    rs->ring = map;
+    rs->ring_block = 0;
+    rs->ring_fd = fd;
+    return 0;
+}
+
+// Open the raw socket the stack sends through, and receives through
+// unless use_ring gets the packet ring set up
+static int raw_setup(tcp_stack_t *stack, int use_ring) {
+    struct raw_state *rs = calloc(1, sizeof(struct raw_state));
+    if (rs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    rs->ring_fd = -1;
+    
+    int fd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+    if (fd < 0) {
+        perror("Raw socket creation failed (need root privileges)");
+        free(rs);
+        return -1;
+    }
+    
+    // Enable IP_HDRINCL so we can build the IP header ourselves
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
+        perror("setsockopt IP_HDRINCL failed");
+        close(fd);
+        free(rs);
+        return -1;
+    }
+    
+    // One kernel queue now holds the traffic of every connection
+    int rcvbuf = TCP_RAW_RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    
+    // With the packet ring receiving, the raw socket only transmits: a
+    // drop-all filter keeps the kernel from queueing a second copy
+    if (use_ring) {
+        struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+        struct sock_fprog prog = { .len = 1, .filter = &drop };
+        if (raw_ring_open(rs, stack) < 0) {
+            printf("Falling back to receiving on the raw socket\n");
+        } else if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+            perror("setsockopt SO_ATTACH_FILTER failed");
+        }
+    }
+    
+    // recvmmsg() fills one slot of the receive batch per packet
+    if (rs->ring_fd < 0) {
+        if (stack->shards > 1 && raw_attach_filter(fd, stack) < 0) {
+            close(fd);
+            free(rs);
+            return -1;
+        }
+        for (int i = 0; i < TCP_RX_BATCH; i++) {
+            rs->rx_bufs[i] = tcp_pktbuf_alloc(&stack->pktpool, 65536);
+            if (rs->rx_bufs[i] == NULL) {
+                while (i-- > 0) {
+                    tcp_pktbuf_free(rs->rx_bufs[i]);
+                }
+                close(fd);
+                free(rs);
+                errno = ENOMEM;
+                return -1;
+            }
+            rs->rx_iov[i].iov_base = rs->rx_bufs[i]->data;
+            rs->rx_iov[i].iov_len = tcp_pktbuf_tailroom(rs->rx_bufs[i]);
+            rs->rx_msgs[i].msg_hdr.msg_iov = &rs->rx_iov[i];
+            rs->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+    
+    rs->fd = fd;
+    stack->backend_priv = rs;
+    return 0;
+}
+
+static int raw_open(tcp_stack_t *stack) {
+    return raw_setup(stack, 0);
+}
+
+static int packet_open(tcp_stack_t *stack) {
+    return raw_setup(stack, 1);
+}
+
+static void raw_close(tcp_stack_t *stack) {
+    struct raw_state *rs = stack->backend_priv;
+    
+    if (rs->ring_fd >= 0) {
+        munmap(rs->ring, (size_t)TCP_RING_BLOCK_SIZE * TCP_RING_BLOCKS);
+        close(rs->ring_fd);
+    }
+    close(rs->fd);
+    for (int i = 0; i < TCP_RX_BATCH; i++) {
+        tcp_pktbuf_free(rs->rx_bufs[i]);
+    }
+    free(rs);
+}
+
+// Send the batch with as few sendmmsg() calls as the kernel allows
+static void raw_xmit(tcp_stack_t *stack, const tcp_pkt_t *pkts, int n) {
+    struct raw_state *rs = stack->backend_priv;
+    
+    for (int i = 0; i < n; i++) {
+        struct sockaddr_in *dst = &rs->tx_dst[i];
+        memset(dst, 0, sizeof(*dst));
+        dst->sin_family = AF_INET;
+        dst->sin_addr.s_addr = pkts[i].dst_addr;
+        
+        struct msghdr *msg = &rs->tx_msgs[i].msg_hdr;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_name = dst;
+        msg->msg_namelen = sizeof(*dst);
+        msg->msg_iov = (struct iovec *)pkts[i].iov;
+        msg->msg_iovlen = pkts[i].iovcnt;
+    }
+    
+    int sent = 0;
+    while (sent < n) {
+        int ret = sendmmsg(rs->fd, rs->tx_msgs + sent, n - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendmmsg failed");
+            sent++;  // Drop it; retransmission recovers the segment
+            continue;
+        }
+        sent += ret;
+    }
+}
+
+static int raw_wait(tcp_stack_t *stack, int timeout_ms) {
+    struct raw_state *rs = stack->backend_priv;
+    return backend_poll_fd(stack, rs->ring_fd >= 0 ? rs->ring_fd : rs->fd, timeout_ms);
+}
+
+// Deliver the frames of every block the kernel has handed over, parsing
+// them in place, and give each block back once it is done
+static int raw_ring_rx(tcp_stack_t *stack, struct raw_state *rs) {
+    int delivered = 0;
+    
+    for (int i = 0; i < TCP_RING_BLOCKS; i++) {
+        struct tpacket_block_desc *bd =
+            (struct tpacket_block_desc *)(rs->ring + (size_t)rs->ring_block * TCP_RING_BLOCK_SIZE);
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+        
+        uint8_t *frame = (uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt;
+        for (uint32_t n = 0; n < bd->hdr.bh1.num_pkts; n++) {
+            struct tpacket3_hdr *ph = (struct tpacket3_hdr *)frame;
+            const struct sockaddr_ll *sll =
+                (const struct sockaddr_ll *)(frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            
+            // Loopback shows our own transmissions too
+            if (sll->sll_pkttype != PACKET_OUTGOING) {
+                int flags = 0;
+                if (ph->tp_status & TP_STATUS_CSUMNOTREADY) {
+                    flags |= TCP_RX_CSUM_PARTIAL;
+                }
+                if (ph->tp_status & TP_STATUS_CSUM_VALID) {
+                    flags |= TCP_RX_CSUM_VALID;
+                }
+                delivered += tcp_stack_input_flags(stack, frame + ph->tp_net, ph->tp_snaplen, flags);
+            }
+            frame += ph->tp_next_offset;
+        }
+        
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        rs->ring_block = (rs->ring_block + 1) % TCP_RING_BLOCKS;
+    }
+    
+    return delivered;
+}
+
+// Take up to TCP_RX_BATCH packets with one recvmmsg() without blocking
+static int raw_rx(tcp_stack_t *stack) {
+    struct raw_state *rs = stack->backend_priv;
+    if (rs->ring_fd >= 0) {
+        return raw_ring_rx(stack, rs);
+    }
+    
+    int n = recvmmsg(rs->fd, rs->rx_msgs, TCP_RX_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+    
+    // A raw socket says nothing about checksum state, and on lo the
+    // kernel's own packets arrive before offload fills theirs in
+    int delivered = 0;
+    for (int i = 0; i < n; i++) {
+        delivered += tcp_stack_input_flags(stack, rs->rx_bufs[i]->data, rs->rx_msgs[i].msg_len,
+                                           TCP_RX_CSUM_PARTIAL);
+    }
+    return delivered;
+}
+
+const tcp_backend_ops_t tcp_backend_raw = {
+    .name = "raw",
+    .open = raw_open,
+    .close = raw_close,
+    .xmit = raw_xmit,
+    .wait = raw_wait,
+    .rx = raw_rx,
+};
+
+const tcp_backend_ops_t tcp_backend_packet = {
+    .name = "packet",
+    .open = packet_open,
+    .close = raw_close,
+    .xmit = raw_xmit,
+    .wait = raw_wait,
+    .rx = raw_rx,
+};
+
+// ---------------------------------------------------------------------------
+// TUN device: the stack is a host of its own behind a point-to-point link,
+// so the kernel's TCP never sees its connections and sends no RSTs
+// ---------------------------------------------------------------------------
+
+struct tun_state {
+    int fd;
+    tcp_pktbuf_t *rx_buf;             // One received packet
+};
+
+// Attach to the TUN device named ifname, or a new one if it is empty, and
+// take the link MTU from it unless one was configured
+static int tun_open(tcp_stack_t *stack) {
+    if (stack->addr == INADDR_ANY) {
+        fprintf(stderr, "A TUN stack needs an address of its own\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if (stack->shards > 1) {
+        // Multiqueue TUN steers by the kernel's flow hash, not tcp_flow_shard()
+        fprintf(stderr, "A TUN stack cannot be sharded\n");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct tun_state *ts = malloc(sizeof(struct tun_state));
+    if (ts == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    ts->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (ts->fd < 0) {
+        perror("open /dev/net/tun failed");
+        free(ts);
+        return -1;
+    }
+    
+    // Bare IPv4 packets, no packet-information prefix
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", stack->ifname);
+    if (ioctl(ts->fd, TUNSETIFF, &ifr) < 0) {
+        perror("ioctl TUNSETIFF failed");
+        close(ts->fd);
+        free(ts);
+        return -1;
+    }
+    snprintf(stack->ifname, sizeof(stack->ifname), "%s", ifr.ifr_name);
+    
+    if (stack->mtu == 0) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd >= 0) {
+            if (ioctl(fd, SIOCGIFMTU, &ifr) == 0) {
+                stack->mtu = ifr.ifr_mtu;
+            }
+            close(fd);
+        }
+    }
+    
+    ts->rx_buf = tcp_pktbuf_alloc(&stack->pktpool, 65536);
+    if (ts->rx_buf == NULL) {
+        close(ts->fd);
+        free(ts);
+        return -1;
+    }
+    
+    printf("Using TUN device %s\n", stack->ifname);
+    stack->backend_priv = ts;
+    return 0;
+}
+
+static void tun_close(tcp_stack_t *stack) {
+    struct tun_state *ts = stack->backend_priv;
+    close(ts->fd);
+    tcp_pktbuf_free(ts->rx_buf);
+    free(ts);
+}
+
+// One writev() per packet; a full device queue drops like a busy link
+static void tun_xmit(tcp_stack_t *stack, const tcp_pkt_t *pkts, int n) {
+    struct tun_state *ts = stack->backend_priv;
+    
+    for (int i = 0; i < n; i++) {
+        if (writev(ts->fd, pkts[i].iov, pkts[i].iovcnt) < 0 && errno != EAGAIN) {
+            perror("write to TUN device failed");
+        }
+    }
+}
+
+static int tun_wait(tcp_stack_t *stack, int timeout_ms) {
+    struct tun_state *ts = stack->backend_priv;
+    return backend_poll_fd(stack, ts->fd, timeout_ms);
+}
+
+// Read up to TCP_RX_BATCH packets, delivering each before the next read
+static int tun_rx(tcp_stack_t *stack) {
+    struct tun_state *ts = stack->backend_priv;
+    int delivered = 0;
+    
+    for (int i = 0; i < TCP_RX_BATCH; i++) {
+        ssize_t n = read(ts->fd, ts->rx_buf->data, tcp_pktbuf_tailroom(ts->rx_buf));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            return -1;
+        }
+        delivered += tcp_stack_input(stack, ts->rx_buf->data, n);
+    }
+    
+    return delivered;
+}
+
+const tcp_backend_ops_t tcp_backend_tun = {
+    .name = "tun",
+    .open = tun_open,
+    .close = tun_close,
+    .xmit = tun_xmit,
+    .wait = tun_wait,
+    .rx = tun_rx,
+};
+
+// ---------------------------------------------------------------------------
+// Memory link: two stacks in one process joined back to back. Each side
+// owns a single-producer/single-consumer ring of MTU-sized slots; the
+// peer's transmit copies packets in and our receive delivers them in
+// place. Both stacks are meant to be driven by one thread: waiting on one
+// side gives the other a turn.
+//
+// tcp_mem_netem() puts an emulated wire in front of the peer's ring:
+// packets are dropped, serialized at the link rate and delayed as
+// configured, and wait in our pool until they are due.
+// ---------------------------------------------------------------------------
+
+struct mem_port {
+    tcp_stack_t *peer;                // Other end, NULL until linked
+    uint32_t slot_size;               // Largest packet accepted: our MTU
+    uint8_t *slots;                   // TCP_MEM_RING slots of slot_size bytes
+    uint32_t lens[TCP_MEM_RING];
+    uint32_t head;                    // Next packet to deliver (written by us)
+    uint32_t tail;                    // Next free slot (written by the peer)
+    int pumping;                      // Polling the peer from our wait
+    
+    // Impairments on what we send
+    int impaired;                     // New packets go through the emulated wire
+    tcp_netem_t netem;
+    uint64_t rng;                     // Generator of the loss, jitter and reorder draws
+    uint64_t wire_free_ns;            // When the wire is done serializing what it has
+    tcp_pktbuf_t *flight;             // Packets on the wire, earliest due first
+    tcp_pktbuf_t *flight_tail;
+    uint32_t nflight;
+};
+
+// A packet on the wire, kept in its buffer's control area
+struct mem_flight {
+    uint64_t due_ns;                  // When it reaches the peer's ring
+    tcp_pktbuf_t *next;               // Next packet due
+};
+
+_Static_assert(sizeof(struct mem_flight) <= sizeof(((tcp_pktbuf_t *)0)->cb),
+               "struct mem_flight must fit in a packet buffer's control area");
+
+static struct mem_flight *mem_flight(tcp_pktbuf_t *pb) {
+    return (struct mem_flight *)pb->cb;
+}
+
+static int mem_open(tcp_stack_t *stack) {
+    if (stack->addr == INADDR_ANY) {
+        fprintf(stderr, "A memory-link stack needs an address of its own\n");
+        errno = EINVAL;
+        return -1;
+    }
+    if (stack->mtu == 0) {
+        stack->mtu = TCP_MTU_DEFAULT;
+    }
+    
+    struct mem_port *mp = calloc(1, sizeof(struct mem_port));
+    if (mp == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    mp->slot_size = stack->mtu;
+    mp->slots = malloc((size_t)TCP_MEM_RING * mp->slot_size);
+    if (mp->slots == NULL) {
+        free(mp);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    stack->backend_priv = mp;
+    return 0;
+}
+
+static void mem_close(tcp_stack_t *stack) {
+    struct mem_port *mp = stack->backend_priv;
+    
+    if (mp->peer) {
+        ((struct mem_port *)mp->peer->backend_priv)->peer = NULL;
+    }
+    while (mp->flight) {
+        tcp_pktbuf_t *pb = mp->flight;
+        mp->flight = mem_flight(pb)->next;
+        tcp_pktbuf_free(pb);
+    }
+    free(mp->slots);
+    free(mp);
+}
+
+static int mem_pending(struct mem_port *mp) {
+    return __atomic_load_n(&mp->tail, __ATOMIC_ACQUIRE) != mp->head;
+}
+
+// Copy a packet of len bytes into slot tail of the peer's ring. Returns 0
+// when the ring is full; the caller publishes the new tail.
+static int mem_put(struct mem_port *pp, uint32_t tail, const struct iovec *iov, int iovcnt, size_t len) {
+    if (tail - __atomic_load_n(&pp->head, __ATOMIC_ACQUIRE) == TCP_MEM_RING) {
+        return 0;
+    }
+    
+    uint32_t slot = tail & (TCP_MEM_RING - 1);
+    uint8_t *p = pp->slots + (size_t)slot * pp->slot_size;
+    for (int v = 0; v < iovcnt; v++) {
+        memcpy(p, iov[v].iov_base, iov[v].iov_len);
+        p += iov[v].iov_len;
+    }
+    pp->lens[slot] = len;
+    return 1;
+}
+
+// Uniform draw from [0, 1) (xorshift64*)
+static double mem_random(struct mem_port *mp) {
+    mp->rng ^= mp->rng >> 12;
+    mp->rng ^= mp->rng << 25;
+    mp->rng ^= mp->rng >> 27;
+    return ((mp->rng * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+// Put a packet on the emulated wire: drop it, or keep a copy in our pool
+// until it is due at the peer. It is serialized behind what the wire
+// already carries and then delayed, unless it is picked to skip the queue.
+static void mem_impair(tcp_stack_t *stack, struct mem_port *mp, const tcp_pkt_t *pkt, size_t len, uint64_t now) {
+    const tcp_netem_t *ne = &mp->netem;
+    uint32_t limit = ne->limit ? ne->limit : TCP_NETEM_LIMIT;
+    if (mp->nflight >= limit || (ne->loss > 0 && mem_random(mp) < ne->loss)) {
+        return;
+    }
+    
+    tcp_pktbuf_t *pb = tcp_pktbuf_alloc(&stack->pktpool, len);
+    if (pb == NULL) {
+        return;
+    }
+    uint8_t *p = tcp_pktbuf_put(pb, len);
+    for (int v = 0; v < pkt->iovcnt; v++) {
+        memcpy(p, pkt->iov[v].iov_base, pkt->iov[v].iov_len);
+        p += pkt->iov[v].iov_len;
+    }
+    
+    uint64_t due = now;
+    if (ne->reorder == 0 || mem_random(mp) >= ne->reorder) {
+        if (ne->rate_bps) {
+            if (mp->wire_free_ns < now) {
+                mp->wire_free_ns = now;
+            }
+            mp->wire_free_ns += len * 8 * 1000000000ULL / ne->rate_bps;
+            due = mp->wire_free_ns;
+        }
+        due += ne->delay_us * 1000ULL;
+        if (ne->jitter_us) {
+            due += (uint64_t)(mem_random(mp) * ne->jitter_us * 1000);
+        }
+    }
+    
+    // Usually the latest packet is due last; jitter and reordering insert
+    // it among the others, after those due at the same time
+    struct mem_flight *f = mem_flight(pb);
+    f->due_ns = due;
+    f->next = NULL;
+    if (mp->flight_tail == NULL || mem_flight(mp->flight_tail)->due_ns <= due) {
+        if (mp->flight_tail) {
+            mem_flight(mp->flight_tail)->next = pb;
+        } else {
+            mp->flight = pb;
+        }
+        mp->flight_tail = pb;
+    } else {
+        tcp_pktbuf_t **link = &mp->flight;
+        while (mem_flight(*link)->due_ns <= due) {
+            link = &mem_flight(*link)->next;
+        }
+        f->next = *link;
+        *link = pb;
+    }
+    mp->nflight++;
+}
+
+// Move the packets on our wire that are due into the peer's ring, in
+// order, while it has room. With the peer gone they are dropped.
+static void mem_land(struct mem_port *mp) {
+    if (mp->flight == NULL) {
+        return;
+    }
+    
+    struct mem_port *pp = mp->peer ? mp->peer->backend_priv : NULL;
+    uint64_t now = tcp_now_ns();
+    uint32_t tail = pp ? pp->tail : 0;
+    while (mp->flight && (pp == NULL || mem_flight(mp->flight)->due_ns <= now)) {
+        tcp_pktbuf_t *pb = mp->flight;
+        if (pp) {
+            struct iovec iov = { .iov_base = pb->data, .iov_len = pb->len };
+            if (!mem_put(pp, tail, &iov, 1, pb->len)) {
+                break;
+            }
+            tail++;
+        }
+        mp->flight = mem_flight(pb)->next;
+        mp->nflight--;
+        tcp_pktbuf_free(pb);
+    }
+    if (mp->flight == NULL) {
+        mp->flight_tail = NULL;
+    }
+    if (pp) {
+        __atomic_store_n(&pp->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+// When the next packet on a wire lands, UINT64_MAX if none is in flight
+static uint64_t mem_next_due(const struct mem_port *mp) {
+    return mp && mp->flight ? mem_flight(mp->flight)->due_ns : UINT64_MAX;
+}
+
+// Copy each packet into the peer's ring, or onto the emulated wire when
+// the link is impaired. Packets that do not fit its MTU or find the ring
+// full are dropped.
+static void mem_xmit(tcp_stack_t *stack, const tcp_pkt_t *pkts, int n) {
+    struct mem_port *mp = stack->backend_priv;
+    if (mp->peer == NULL) {
+        return;
+    }
+    
+    struct mem_port *pp = mp->peer->backend_priv;
+    if (mp->impaired) {
+        uint64_t now = tcp_now_ns();
+        for (int i = 0; i < n; i++) {
+            size_t len = pkts[i].iov[0].iov_len + (pkts[i].iovcnt > 1 ? pkts[i].iov[1].iov_len : 0);
+            if (len <= pp->slot_size) {
+                mem_impair(stack, mp, &pkts[i], len, now);
+            }
+        }
+        mem_land(mp);
+        return;
+    }
+    
+    uint32_t tail = pp->tail;
+    for (int i = 0; i < n; i++) {
+        size_t len = pkts[i].iov[0].iov_len + (pkts[i].iovcnt > 1 ? pkts[i].iov[1].iov_len : 0);
+        if (len <= pp->slot_size && mem_put(pp, tail, pkts[i].iov, pkts[i].iovcnt, len)) {
+            tail++;
+        }
+    }
+    __atomic_store_n(&pp->tail, tail, __ATOMIC_RELEASE);
+}
+
+// Give the peer a turn until it has sent us something or timeout_ms runs
+// out, napping a millisecond at a time while both sides are idle
+static int mem_wait(tcp_stack_t *stack, int timeout_ms) {
+    struct mem_port *mp = stack->backend_priv;
+    uint64_t deadline = timeout_ms >= 0 ? tcp_now_ns() + timeout_ms * 1000000ULL : UINT64_MAX;
+    
+    while (1) {
+        // Packets on either wire land once they are due
+        struct mem_port *pp = mp->peer ? mp->peer->backend_priv : NULL;
+        mem_land(mp);
+        if (pp) {
+            mem_land(pp);
+        }
+        if (mem_pending(mp)) {
+            return 1;
+        }
+        
+        // The peer's poll must not turn around and poll us
+        if (pp && !mp->pumping && !pp->pumping) {
+            mp->pumping = 1;
+            int ret = tcp_stack_poll(mp->peer, 0);
+            mp->pumping = 0;
+            if (ret < 0) {
+                return -1;
+            }
+            if (mem_pending(mp)) {
+                return 1;
+            }
+        }
+        
+        uint64_t now = tcp_now_ns();
+        if (now >= deadline) {
+            return 0;
+        }
+        
+        // Spin while a packet is about to land on either side
+        uint64_t due = mem_next_due(mp);
+        if (mem_next_due(pp) < due) {
+            due = mem_next_due(pp);
+        }
+        if (due < now + 1000000) {
+            continue;
+        }
+        
+        // Nap for a millisecond, less if an application thread wakes us
+        struct pollfd pfd = { .fd = stack->wake_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 1) > 0) {
+            return 0;
+        }
+    }
+}
+
+// Deliver up to TCP_RX_BATCH packets in place, freeing each slot after it
+static int mem_rx(tcp_stack_t *stack) {
+    struct mem_port *mp = stack->backend_priv;
+    int delivered = 0;
+    
+    for (int i = 0; i < TCP_RX_BATCH && mem_pending(mp); i++) {
+        uint32_t slot = mp->head & (TCP_MEM_RING - 1);
+        delivered += tcp_stack_input(stack, mp->slots + (size_t)slot * mp->slot_size, mp->lens[slot]);
+        __atomic_store_n(&mp->head, mp->head + 1, __ATOMIC_RELEASE);
+    }
+    
+    return delivered;
+}
+
+const tcp_backend_ops_t tcp_backend_mem = {
+    .name = "mem",
+    .open = mem_open,
+    .close = mem_close,
+    .xmit = mem_xmit,
+    .wait = mem_wait,
+    .rx = mem_rx,
+};
+
+int tcp_mem_link(tcp_stack_t *a, tcp_stack_t *b) {
+    if (a == b || a->backend != &tcp_backend_mem || b->backend != &tcp_backend_mem) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct mem_port *pa = a->backend_priv;
+    struct mem_port *pb = b->backend_priv;
+    if (pa->peer || pb->peer) {
+        errno = EBUSY;
+        return -1;
+    }
+    
+    pa->peer = b;
+    pb->peer = a;
+    return 0;
+}
+
+int tcp_mem_netem(tcp_stack_t *stack, const tcp_netem_t *netem) {
+    if (stack->backend != &tcp_backend_mem) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct mem_port *mp = stack->backend_priv;
+    if (netem == NULL) {
+        mp->impaired = 0;             // Packets on the wire still land when due
+        return 0;
+    }
+    if (!(netem->loss >= 0 && netem->loss <= 1 && netem->reorder >= 0 && netem->reorder <= 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    mp->netem = *netem;
+    mp->rng = (uint64_t)netem->seed << 32 | 0x9E3779B9;  // Never zero
+    mp->impaired = 1;
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef TCP_BACKEND_H
+#define TCP_BACKEND_H
+
+#include "tcp_lite.h"
+
+// Link-layer backends shipped with TCP Lite
+extern const tcp_backend_ops_t tcp_backend_raw;     // Raw IP socket (default)
+extern const tcp_backend_ops_t tcp_backend_packet;  // TPACKET_V3 ring in, raw socket out
+extern const tcp_backend_ops_t tcp_backend_tun;     // TUN device owned by the stack
+extern const tcp_backend_ops_t tcp_backend_mem;     // In-process link to another stack
+
+// Connect two stacks created with tcp_backend_mem back to back
+int tcp_mem_link(tcp_stack_t *a, tcp_stack_t *b);
+
+// Impair the packets stack sends over its memory link, or restore a
+// perfect link with NULL. An impaired link must be driven by one thread.
+int tcp_mem_netem(tcp_stack_t *stack, const tcp_netem_t *netem);
+
+#endif // TCP_BACKEND_H
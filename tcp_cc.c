@@ -0,0 +1,174 @@
+#include "tcp_cc.h"
+#include "tcp_clock.h"
+#include <string.h>
+#include <math.h>
+
+// Flight size for ssthresh after a loss (RFC 5681 eq. 4)
+static uint32_t cc_loss_ssthresh(const tcp_socket_t *sock) {
+    uint32_t flight = sock->snd_nxt - sock->snd_una;
+    return flight / 2 > 2 * sock->mss ? flight / 2 : 2 * sock->mss;
+}
+
+// Slow start: grow by the bytes acked, at most one MSS per ACK (RFC 5681/3465)
+static void cc_slow_start(tcp_socket_t *sock, uint32_t acked) {
+    sock->cwnd += acked < sock->mss ? acked : sock->mss;
+}
+
+// ---------------------------------------------------------------------------
+// NewReno (RFC 5681, RFC 6582)
+// ---------------------------------------------------------------------------
+
+struct newreno_state {
+    uint32_t bytes_acked;  // Acked bytes counted towards the next cwnd increase
+};
+
+static void newreno_init(tcp_socket_t *sock) {
+    struct newreno_state *nr = (struct newreno_state *)sock->cc_priv;
+    nr->bytes_acked = 0;
+}
+
+static void newreno_on_ack(tcp_socket_t *sock, uint32_t acked) {
+    struct newreno_state *nr = (struct newreno_state *)sock->cc_priv;
+    
+    if (sock->cwnd < sock->ssthresh) {
+        cc_slow_start(sock, acked);
+        return;
+    }
+    
+    // Congestion avoidance: one MSS per window's worth of acked data
+    nr->bytes_acked += acked;
+    if (nr->bytes_acked >= sock->cwnd) {
+        nr->bytes_acked -= sock->cwnd;
+        sock->cwnd += sock->mss;
+    }
+}
+
+static void newreno_on_loss(tcp_socket_t *sock) {
+    sock->ssthresh = cc_loss_ssthresh(sock);
+    sock->cwnd = sock->ssthresh + TCP_DUPACK_THRESHOLD * sock->mss;
+}
+
+static void newreno_on_rto(tcp_socket_t *sock) {
+    struct newreno_state *nr = (struct newreno_state *)sock->cc_priv;
+    sock->ssthresh = cc_loss_ssthresh(sock);
+    sock->cwnd = sock->mss;
+    nr->bytes_acked = 0;
+}
+
+const tcp_cc_ops_t tcp_cc_newreno = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_rto = newreno_on_rto,
+};
+
+// ---------------------------------------------------------------------------
+// CUBIC (RFC 9438)
+// ---------------------------------------------------------------------------
+
+#define CUBIC_C     0.4   // Scaling constant (segments / s^3)
+#define CUBIC_BETA  0.7   // Multiplicative decrease factor
+
+struct cubic_state {
+    double   w_max;        // Window before the last reduction (segments)
+    double   k;            // Time to return to w_max (s)
+    double   origin;       // Window the cubic curve is centred on (segments)
+    double   w_est;        // Reno-friendly window estimate (segments)
+    uint64_t epoch_start;  // Start of the current avoidance epoch (ms, 0 = none)
+};
+
+_Static_assert(sizeof(struct cubic_state) <= sizeof(((tcp_socket_t *)0)->cc_priv),
+               "cubic_state does not fit in cc_priv");
+
+static void cubic_init(tcp_socket_t *sock) {
+    struct cubic_state *cs = (struct cubic_state *)sock->cc_priv;
+    memset(cs, 0, sizeof(*cs));
+}
+
+static void cubic_on_ack(tcp_socket_t *sock, uint32_t acked) {
+    struct cubic_state *cs = (struct cubic_state *)sock->cc_priv;
+    
+    if (sock->cwnd < sock->ssthresh) {
+        cc_slow_start(sock, acked);
+        return;
+    }
+    
+    double cwnd = (double)sock->cwnd / sock->mss;
+    uint64_t now = tcp_now_ms();
+    
+    if (cs->epoch_start == 0) {
+        cs->epoch_start = now;
+        if (cwnd < cs->w_max) {
+            cs->k = cbrt((cs->w_max - cwnd) / CUBIC_C);
+            cs->origin = cs->w_max;
+        } else {
+            cs->k = 0;
+            cs->origin = cwnd;
+        }
+        cs->w_est = cwnd;
+    }
+    
+    // Window the cubic function asks for one RTT from now
+    double t = (now - cs->epoch_start + sock->srtt_us / 1000) / 1000.0;
+    double target = cs->origin + CUBIC_C * (t - cs->k) * (t - cs->k) * (t - cs->k);
+    
+    // Never be less aggressive than standard TCP would be
+    cs->w_est += 3.0 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ((double)acked / sock->mss) / cwnd;
+    if (target < cs->w_est) {
+        target = cs->w_est;
+    }
+    
+    // Grow by (target - cwnd) / cwnd segments per segment acked
+    double inc = target > cwnd ? (target - cwnd) / cwnd : 0.01 / cwnd;
+    if (inc > 0.5) {
+        inc = 0.5;  // At most 1.5x per RTT
+    }
+    sock->cwnd += (uint32_t)(inc * acked);
+}
+
+static void cubic_reduce(tcp_socket_t *sock) {
+    struct cubic_state *cs = (struct cubic_state *)sock->cc_priv;
+    double cwnd = (double)sock->cwnd / sock->mss;
+    
+    // Fast convergence: release bandwidth when the window is still shrinking
+    cs->w_max = cwnd < cs->w_max ? cwnd * (1 + CUBIC_BETA) / 2 : cwnd;
+    cs->epoch_start = 0;
+    
+    uint32_t ssthresh = (uint32_t)(sock->cwnd * CUBIC_BETA);
+    sock->ssthresh = ssthresh > 2 * sock->mss ? ssthresh : 2 * sock->mss;
+}
+
+static void cubic_on_loss(tcp_socket_t *sock) {
+    cubic_reduce(sock);
+    sock->cwnd = sock->ssthresh;
+}
+
+static void cubic_on_rto(tcp_socket_t *sock) {
+    cubic_reduce(sock);
+    sock->cwnd = sock->mss;
+}
+
+const tcp_cc_ops_t tcp_cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_rto = cubic_on_rto,
+};
+
+// ---------------------------------------------------------------------------
+
+static const tcp_cc_ops_t *cc_algorithms[] = {
+    &tcp_cc_cubic,
+    &tcp_cc_newreno,
+};
+
+const tcp_cc_ops_t *tcp_cc_find(const char *name) {
+    for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); i++) {
+        if (strcmp(cc_algorithms[i]->name, name) == 0) {
+            return cc_algorithms[i];
+        }
+    }
+    return NULL;
+}
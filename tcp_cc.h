@@ -0,0 +1,13 @@
+#ifndef TCP_CC_H
+#define TCP_CC_H
+
+#include "tcp_lite.h"
+
+// Congestion control algorithms shipped with TCP Lite
+extern const tcp_cc_ops_t tcp_cc_newreno;
+extern const tcp_cc_ops_t tcp_cc_cubic;
+
+// Look up an algorithm by name, NULL if unknown
+const tcp_cc_ops_t *tcp_cc_find(const char *name);
+
+#endif // TCP_CC_H
@@ -0,0 +1,25 @@
+#ifndef TCP_CLOCK_H
+#define TCP_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// The stack's clock: CLOCK_MONOTONIC, shared by the protocol timers,
+// congestion control, the rings and the backends so all their timestamps
+// can be compared
+
+static inline uint64_t tcp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t tcp_now_us(void) {
+    return tcp_now_ns() / 1000;
+}
+
+static inline uint64_t tcp_now_ms(void) {
+    return tcp_now_ns() / 1000000;
+}
+
+#endif // TCP_CLOCK_H
@@ -0,0 +1,201 @@
+#include "tcp_csum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CSUM_X86 1
+#include <immintrin.h>
+#endif
+
+// The one's-complement sum is endian-neutral (RFC 1071): adding the buffer
+// as native 32-bit words into a 64-bit accumulator and folding the carries
+// back in at the end gives the same 16-bit result as adding it a 16-bit word
+// at a time. Only a trailing odd byte needs to know which half it lands in.
+
+// Fold a 64-bit accumulator and a 32-bit partial sum into a 32-bit partial sum
+static uint32_t csum_fold64(uint64_t acc, uint32_t sum) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc += sum;
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+// Bytes left over after the wide loop (loads are unaligned-safe)
+static uint64_t csum_tail(const uint8_t *p, size_t len, uint64_t acc) {
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        acc += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t w;
+        memcpy(&w, p, 2);
+        acc += w;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        acc += (uint32_t)*p << 8;
+#else
+        acc += *p;
+#endif
+    }
+    return acc;
+}
+
+// ---------------------------------------------------------------------------
+// Portable: 32 bytes per iteration into two 64-bit accumulators
+// ---------------------------------------------------------------------------
+
+static int csum_scalar_supported(void) {
+    return 1;
+}
+
+static uint32_t csum_scalar(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    uint64_t acc0 = 0, acc1 = 0;
+    
+    while (len >= 32) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof(w));
+        acc0 += (uint32_t)w[0];
+        acc1 += w[0] >> 32;
+        acc0 += (uint32_t)w[1];
+        acc1 += w[1] >> 32;
+        acc0 += (uint32_t)w[2];
+        acc1 += w[2] >> 32;
+        acc0 += (uint32_t)w[3];
+        acc1 += w[3] >> 32;
+        p += 32;
+        len -= 32;
+    }
+    
+    return csum_fold64(csum_tail(p, len, acc0 + acc1), sum);
+}
+
+static const tcp_csum_impl_t tcp_csum_scalar = {
+    .name = "scalar64",
+    .supported = csum_scalar_supported,
+    .partial = csum_scalar,
+};
+
+#ifdef CSUM_X86
+
+// ---------------------------------------------------------------------------
+// SSE2 / AVX2: zero-extend each 32-bit word to 64 bits and add lane-wise,
+// so the accumulators cannot overflow on any buffer we will ever see
+// ---------------------------------------------------------------------------
+
+static int csum_sse2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static uint32_t csum_sse2(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    
+    while (len >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+        p += 32;
+        len -= 32;
+    }
+    
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+    return csum_fold64(csum_tail(p, len, lanes[0] + lanes[1]), sum);
+}
+
+static const tcp_csum_impl_t tcp_csum_sse2 = {
+    .name = "sse2",
+    .supported = csum_sse2_supported,
+    .partial = csum_sse2,
+};
+
+static int csum_avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static uint32_t csum_avx2(const void *buf, size_t len, uint32_t sum) {
+    const uint8_t *p = buf;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    
+    while (len >= 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+        p += 64;
+        len -= 64;
+    }
+    if (len >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        p += 32;
+        len -= 32;
+    }
+    
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    uint64_t acc = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return csum_fold64(csum_tail(p, len, acc), sum);
+}
+
+static const tcp_csum_impl_t tcp_csum_avx2 = {
+    .name = "avx2",
+    .supported = csum_avx2_supported,
+    .partial = csum_avx2,
+};
+
+#endif // CSUM_X86
+
+const tcp_csum_impl_t *const tcp_csum_impls[] = {
+    &tcp_csum_scalar,
+#ifdef CSUM_X86
+    &tcp_csum_sse2,
+    &tcp_csum_avx2,
+#endif
+};
+
+const size_t tcp_csum_impl_count = sizeof(tcp_csum_impls) / sizeof(tcp_csum_impls[0]);
+
+static const tcp_csum_impl_t *csum_impl;
+
+void tcp_csum_init(void) {
+    for (size_t i = tcp_csum_impl_count; i-- > 0;) {
+        if (tcp_csum_impls[i]->supported()) {
+            csum_impl = tcp_csum_impls[i];
+            return;
+        }
+    }
+}
+
+const tcp_csum_impl_t *tcp_csum_active(void) {
+    if (csum_impl == NULL) {
+        tcp_csum_init();
+    }
+    return csum_impl;
+}
+
+uint32_t tcp_csum_partial(const void *buf, size_t len, uint32_t sum) {
+    if (csum_impl == NULL) {
+        tcp_csum_init();
+    }
+    return csum_impl->partial(buf, len, sum);
+}
@@ -0,0 +1,45 @@
+#ifndef TCP_CSUM_H
+#define TCP_CSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+// Internet checksum (RFC 1071) kernels. A partial sum is the one's-complement
+// sum of the bytes in memory order, not yet folded or complemented; sums of
+// consecutive even-length pieces can be chained through the sum argument.
+typedef struct tcp_csum_impl {
+    const char *name;
+    int (*supported)(void);                                  // Usable on this CPU
+    uint32_t (*partial)(const void *buf, size_t len, uint32_t sum);
+} tcp_csum_impl_t;
+
+// Every kernel built in, fastest last; the scalar one always works
+extern const tcp_csum_impl_t *const tcp_csum_impls[];
+extern const size_t tcp_csum_impl_count;
+
+// Pick the fastest kernel the CPU supports. Done on first use otherwise.
+void tcp_csum_init(void);
+
+// Kernel chosen by tcp_csum_init()
+const tcp_csum_impl_t *tcp_csum_active(void);
+
+// Add len bytes at buf to a partial sum
+uint32_t tcp_csum_partial(const void *buf, size_t len, uint32_t sum);
+
+// Partial sum of the IPv4 pseudo header (addresses in network byte order,
+// length in host order) without building it in memory
+static inline uint32_t tcp_csum_pseudo(uint32_t src, uint32_t dst, uint8_t proto, uint16_t len) {
+    uint64_t sum = (uint64_t)src + dst + htons(proto) + htons(len);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)((sum & 0xFFFFFFFF) + (sum >> 32));
+}
+
+// Fold a partial sum to 16 bits and complement it: the header field value
+static inline uint16_t tcp_csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+#endif // TCP_CSUM_H
@@ -1,6 +1,13 @@
 #include "tcp_lite.h"
+#include "tcp_cc.h"
+#include "tcp_csum.h"
+#include "tcp_backend.h"
+#include "tcp_timer.h"
+#include "tcp_pktbuf.h"
+#include "tcp_clock.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -10,77 +17,552 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <pthread.h>
 
-// Global socket table
-static tcp_socket_t socket_table[MAX_SOCKETS];
-static int initialized = 0;
+// Sequence number comparisons (modulo 2^32)
+#define SEQ_LT(a, b)   ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)  ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)   ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b)  ((int32_t)((a) - (b)) >= 0)
 
-// Initialize the TCP stack
+#define TCP_OPTLEN_TIMESTAMP 12  // NOP, NOP, kind, length, TSval, TSecr
+
+// Count an event in a stack's MIB. Only the stack's own thread writes it; a
+// relaxed store lets tcp_stack_mib() read from other threads without
+// making the increment a locked instruction.
+#define TCP_MIB_INC(stack, field) \
+    __atomic_store_n(&(stack)->mib.field, (stack)->mib.field + 1, __ATOMIC_RELAXED)
+
+// Options carried by an incoming segment
+struct tcp_opts {
+    uint16_t mss;                     // 0 if absent
+    int      wscale;                  // -1 if absent
+    int      ts_present;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    int      sack_perm;
+    int      sack_count;
+    tcp_seq_range_t sack[TCP_MAX_SACK_BLOCKS];
+};
+
+// Incoming segment: header, options and payload. The payload points into
+// the backend's receive buffer and stays valid until the next receive.
+struct tcp_rx_seg {
+    struct tcp_header hdr;
+    struct tcp_opts opts;
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    const uint8_t *data;
+    size_t data_len;
+};
+
+// Control blocks are carved from slabs and recycled through a free list
+// (linked through hash_next), so allocate and free are O(1). Slabs are
+// kept for reuse; the buffers that dominate a connection's footprint are
+// allocated on demand and released with the connection.
+typedef struct tcp_slab {
+    struct tcp_slab *next;
+    tcp_socket_t socks[TCP_SLAB_SOCKETS];
+} tcp_slab_t;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Every stack instance by id; id 0 is reserved for the default stack.
+// Creating and destroying stacks takes stack_lock; descriptor lookups read
+// the table without it.
+static tcp_stack_t *stack_table[TCP_MAX_STACKS];
+static tcp_stack_t *default_stack;
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Backend and interface the default stack is created with
+static const tcp_backend_ops_t *default_backend = &tcp_backend_raw;
+static char default_ifname[IF_NAMESIZE];
+
+static void tcp_init_once(void) {
+    tcp_csum_init();
+}
+
+// Initialize the TCP stack (any thread, any number of times)
 void tcp_init(void) {
-    if (initialized) return;
+    pthread_once(&init_once, tcp_init_once);
+}
+
+// Choose the receive backend of the default stack. ifname restricts the
+// packet ring to one interface (NULL = all). Must come before the first
+// socket; if the ring cannot be set up the raw socket is used instead.
+int tcp_init_rx(int backend, const char *ifname) {
+    if (backend != TCP_RX_RAW && backend != TCP_RX_PACKET_MMAP) {
+        errno = EINVAL;
+        return -1;
+    }
     
-    memset(socket_table, 0, sizeof(socket_table));
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        socket_table[i].fd = -1;
-        socket_table[i].is_used = 0;
+    pthread_mutex_lock(&stack_lock);
+    if (default_stack) {
+        pthread_mutex_unlock(&stack_lock);
+        errno = EBUSY;
+        return -1;
     }
+    default_backend = backend == TCP_RX_PACKET_MMAP ? &tcp_backend_packet : &tcp_backend_raw;
+    snprintf(default_ifname, sizeof(default_ifname), "%s", ifname ? ifname : "");
+    pthread_mutex_unlock(&stack_lock);
     
-    srand(time(NULL));
-    initialized = 1;
+    tcp_init();
+    return 0;
 }
 
-// Calculate checksum (16-bit one's complement)
+// Calculate checksum (16-bit one's complement) with the fastest kernel
+// the CPU supports
 uint16_t tcp_checksum(const void *buf, size_t len) {
-    const uint16_t *ptr = buf;
-    uint32_t sum = 0;
+    return tcp_csum_fold(tcp_csum_partial(buf, len, 0));
+}
+
+// IP checksum (same algorithm)
+uint16_t ip_checksum(const void *buf, size_t len) {
+    return tcp_checksum(buf, len);
+}
+
+// Per-stack xorshift generator, so threads do not share rand()'s lock
+static uint32_t tcp_random(tcp_stack_t *stack) {
+    uint32_t x = stack->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    stack->rand_state = x;
+    return x;
+}
+
+// Start one of a connection's timers to fire ms from now, restarting it
+// if it is pending
+static void tcp_set_timer(tcp_socket_t *sock, int kind, uint32_t ms) {
+    tcp_timer_add(&sock->stack->timers, &sock->timers[kind], tcp_now_ms() + ms);
+}
+
+static void tcp_clear_timer(tcp_socket_t *sock, int kind) {
+    tcp_timer_del(&sock->stack->timers, &sock->timers[kind]);
+}
+
+// Take a zeroed control block from the stack's free list, adding a slab if empty
+static tcp_socket_t *tcp_sock_alloc(tcp_stack_t *stack) {
+    if (stack->sock_free_list == NULL) {
+        tcp_slab_t *slab = calloc(1, sizeof(tcp_slab_t));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = stack->slab_list;
+        stack->slab_list = slab;
+        for (int i = TCP_SLAB_SOCKETS - 1; i >= 0; i--) {
+            slab->socks[i].hash_next = stack->sock_free_list;
+            stack->sock_free_list = &slab->socks[i];
+        }
+    }
     
-    while (len > 1) {
-        sum += *ptr++;
-        len -= 2;
+    tcp_socket_t *sock = stack->sock_free_list;
+    stack->sock_free_list = sock->hash_next;
+    memset(sock, 0, sizeof(tcp_socket_t));
+    sock->stack = stack;
+    return sock;
+}
+
+static void tcp_sock_release(tcp_socket_t *sock) {
+    sock->hash_next = sock->stack->sock_free_list;
+    sock->stack->sock_free_list = sock;
+}
+
+// Give sock a descriptor, doubling the table when none is free
+static int tcp_fd_alloc(tcp_socket_t *sock) {
+    tcp_stack_t *stack = sock->stack;
+    
+    if (stack->fd_free_count == 0) {
+        int size = stack->fd_table_size ? stack->fd_table_size * 2 : TCP_FD_TABLE_MIN;
+        if (size > 1 << TCP_STACK_SHIFT) {
+            errno = EMFILE;
+            return -1;
+        }
+        
+        tcp_socket_t **table = realloc(stack->fd_table, size * sizeof(tcp_socket_t *));
+        if (table == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        stack->fd_table = table;
+        
+        int *free_fds = realloc(stack->fd_free, size * sizeof(int));
+        if (free_fds == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        stack->fd_free = free_fds;
+        
+        // Push the new descriptors highest first so the lowest is used next
+        for (int i = size - 1; i >= stack->fd_table_size; i--) {
+            stack->fd_table[i] = NULL;
+            stack->fd_free[stack->fd_free_count++] = i;
+        }
+        stack->fd_table_size = size;
     }
     
-    if (len == 1) {
-        sum += *(uint8_t *)ptr;
+    int i = stack->fd_free[--stack->fd_free_count];
+    stack->fd_table[i] = sock;
+    sock->sockfd = (stack->id << TCP_STACK_SHIFT) | i;
+    return sock->sockfd;
+}
+
+// Give sock's descriptor back; a connection left in TIME_WAIT by
+// tcp_close() has none
+static void tcp_fd_release(tcp_socket_t *sock) {
+    tcp_stack_t *stack = sock->stack;
+    if (sock->sockfd < 0) {
+        return;
     }
     
-    while (sum >> 16) {
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    int i = TCP_FD_INDEX(sock->sockfd);
+    stack->fd_table[i] = NULL;
+    stack->fd_free[stack->fd_free_count++] = i;
+    sock->sockfd = -1;
+}
+
+// Stack a socket or tcp_epoll descriptor belongs to, NULL if none
+static tcp_stack_t *tcp_fd_stack(int fd) {
+    if (fd < 0 || TCP_FD_STACK(fd) >= TCP_MAX_STACKS) {
+        return NULL;
     }
+    return __atomic_load_n(&stack_table[TCP_FD_STACK(fd)], __ATOMIC_ACQUIRE);
+}
+
+// Control block behind a descriptor; NULL with errno = EBADF if none
+static tcp_socket_t *tcp_get_socket(int sockfd) {
+    tcp_stack_t *stack = tcp_fd_stack(sockfd);
+    int i = TCP_FD_INDEX(sockfd);
     
-    return ~sum;
+    if (stack == NULL || i >= stack->fd_table_size || stack->fd_table[i] == NULL) {
+        errno = EBADF;
+        return NULL;
+    }
+    return stack->fd_table[i];
 }
 
-// IP checksum (same algorithm)
-uint16_t ip_checksum(const void *buf, size_t len) {
-    return tcp_checksum(buf, len);
+// Smallest window scale that lets us advertise a whole receive buffer
+static uint8_t tcp_wscale_for(uint32_t size) {
+    uint8_t wscale = 0;
+    while ((size >> wscale) > TCP_WINDOW_SIZE && wscale < TCP_MAX_WSCALE) {
+        wscale++;
+    }
+    return wscale;
+}
+
+
+// Receive window to advertise: free space in the receive ring
+static uint32_t tcp_rcv_window(const tcp_socket_t *sock) {
+    return sock->rcvbuf_size - sock->recv_len;
+}
+
+// Window field for an outgoing segment. SYNs are never scaled (RFC 7323).
+static uint16_t tcp_window_field(const tcp_socket_t *sock, uint8_t flags) {
+    uint32_t wnd = tcp_rcv_window(sock);
+    if (!(flags & TCP_SYN)) {
+        wnd >>= sock->rcv_wscale;
+    }
+    return wnd > TCP_WINDOW_SIZE ? TCP_WINDOW_SIZE : wnd;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
 }
 
-// Find free socket slot
-static int find_free_socket(void) {
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (!socket_table[i].is_used) {
-            return i;
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Write the options for an outgoing segment carrying data_len bytes and
+// return their length. Our SYN offers everything; a SYN-ACK only answers
+// what the peer offered.
+static int tcp_write_options(const tcp_socket_t *sock, uint8_t flags, size_t data_len, uint8_t *opt) {
+    int offer = (flags & (TCP_SYN | TCP_ACK)) == TCP_SYN;
+    int len = 0;
+    
+    if (flags & TCP_SYN) {
+        opt[len++] = TCP_OPT_MSS;
+        opt[len++] = 4;
+        put_be16(opt + len, sock->adv_mss);
+        len += 2;
+        
+        if (offer || sock->ws_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_WSCALE;
+            opt[len++] = 3;
+            opt[len++] = sock->rcv_wscale;
+        }
+        
+        if (offer || sock->sack_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_SACK_PERM;
+            opt[len++] = 2;
         }
     }
-    return -1;
+    
+    if (offer || sock->ts_ok) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_TIMESTAMP;
+        opt[len++] = 10;
+        put_be32(opt + len, (uint32_t)tcp_now_ms());
+        put_be32(opt + len + 4, offer ? 0 : sock->ts_recent);
+        len += 8;
+    }
+    
+    // Report the out-of-order ranges we hold, the one holding the latest
+    // segment first (RFC 2018 section 4). Segments are cut to leave room for
+    // the timestamp option only, so on a data segment the blocks get what
+    // the payload leaves of the peer's MSS.
+    int space = 40 - len;
+    int left = (int)sock->mss + (sock->ts_ok ? TCP_OPTLEN_TIMESTAMP : 0) - len - (int)data_len;
+    if (data_len > 0 && left < space) {
+        space = left;
+    }
+    if (sock->sack_ok && sock->ooo_count > 0 && !(flags & TCP_SYN) && space >= 12) {
+        int room = (space - 4) / 8;
+        int n = sock->ooo_count < room ? sock->ooo_count : room;
+        if (n > TCP_MAX_SACK_BLOCKS) {
+            n = TCP_MAX_SACK_BLOCKS;
+        }
+        
+        int first = 0;
+        for (int i = 0; i < sock->ooo_count; i++) {
+            if (SEQ_GEQ(sock->sack_recent, sock->ooo[i].start) &&
+                SEQ_LT(sock->sack_recent, sock->ooo[i].end)) {
+                first = i;
+                break;
+            }
+        }
+        
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_SACK;
+        opt[len++] = 2 + 8 * n;
+        for (int i = 0; i < n; i++) {
+            const tcp_seq_range_t *r = &sock->ooo[(first + i) % sock->ooo_count];
+            put_be32(opt + len, r->start);
+            put_be32(opt + len + 4, r->end);
+            len += 8;
+        }
+    }
+    
+    return len;
+}
+
+// Parse the options of an incoming segment
+static void tcp_parse_options(const uint8_t *opt, int len, struct tcp_opts *opts) {
+    opts->mss = 0;
+    opts->wscale = -1;
+    opts->ts_present = 0;
+    opts->sack_perm = 0;
+    opts->sack_count = 0;
+    
+    int i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == TCP_OPT_EOL) {
+            break;
+        }
+        if (kind == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        
+        if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len) {
+            break;  // Malformed option list
+        }
+        uint8_t olen = opt[i + 1];
+        
+        switch (kind) {
+        case TCP_OPT_MSS:
+            if (olen == 4) {
+                opts->mss = (opt[i + 2] << 8) | opt[i + 3];
+            }
+            break;
+        case TCP_OPT_WSCALE:
+            if (olen == 3) {
+                opts->wscale = opt[i + 2] > TCP_MAX_WSCALE ? TCP_MAX_WSCALE : opt[i + 2];
+            }
+            break;
+        case TCP_OPT_SACK_PERM:
+            if (olen == 2) {
+                opts->sack_perm = 1;
+            }
+            break;
+        case TCP_OPT_SACK:
+            for (int b = 0; b < (olen - 2) / 8 && opts->sack_count < TCP_MAX_SACK_BLOCKS; b++) {
+                opts->sack[opts->sack_count].start = get_be32(opt + i + 2 + 8 * b);
+                opts->sack[opts->sack_count].end = get_be32(opt + i + 6 + 8 * b);
+                opts->sack_count++;
+            }
+            break;
+        case TCP_OPT_TIMESTAMP:
+            if (olen == 10) {
+                opts->ts_present = 1;
+                opts->ts_val = get_be32(opt + i + 2);
+                opts->ts_ecr = get_be32(opt + i + 6);
+            }
+            break;
+        }
+        i += olen;
+    }
+}
+
+// Store len bytes in the receive ring at offset off past the read position
+static void tcp_rbuf_write(tcp_socket_t *sock, uint32_t off,
+                           const uint8_t *data, uint32_t len) {
+    uint32_t pos = (sock->recv_head + off) % sock->rcvbuf_size;
+    uint32_t first = sock->rcvbuf_size - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(sock->recv_buffer + pos, data, first);
+    memcpy(sock->recv_buffer, data + first, len - first);
+}
+
+// Free len bytes at the read position of the receive ring
+static void tcp_rbuf_consume(tcp_socket_t *sock, uint32_t len) {
+    sock->recv_head = (sock->recv_head + len) % sock->rcvbuf_size;
+    sock->recv_len -= len;
+}
+
+// Consume len in-order bytes from the receive ring
+static void tcp_rbuf_read(tcp_socket_t *sock, uint8_t *out, uint32_t len) {
+    uint32_t first = sock->rcvbuf_size - sock->recv_head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(out, sock->recv_buffer + sock->recv_head, first);
+    memcpy(out + first, sock->recv_buffer, len - first);
+    tcp_rbuf_consume(sock, len);
+}
+
+// Copy len in-order bytes from the receive ring without consuming them
+static void tcp_rbuf_peek(const tcp_socket_t *sock, uint8_t *out, uint32_t len) {
+    uint32_t first = sock->rcvbuf_size - sock->recv_head;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(out, sock->recv_buffer + sock->recv_head, first);
+    memcpy(out + first, sock->recv_buffer, len - first);
+}
+
+// Append len bytes to the send ring (the caller checked there is room)
+static void tcp_sbuf_write(tcp_socket_t *sock, const uint8_t *data, uint32_t len) {
+    uint32_t pos = (sock->snd_head + sock->snd_len) % sock->sndbuf_size;
+    uint32_t first = sock->sndbuf_size - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(sock->send_buffer + pos, data, first);
+    memcpy(sock->send_buffer, data + first, len - first);
+    sock->snd_len += len;
+}
+
+// Record [start, end) as held out of order, merging with overlapping or
+// adjacent ranges. Returns -1 if the range table is full.
+static int tcp_ooo_insert(tcp_socket_t *sock, uint32_t start, uint32_t end) {
+    tcp_seq_range_t *ooo = sock->ooo;
+    int n = sock->ooo_count;
+    int i = 0;
+    
+    while (i < n && SEQ_LT(ooo[i].end, start)) {
+        i++;
+    }
+    
+    if (i < n && SEQ_LEQ(ooo[i].start, end)) {
+        if (SEQ_LT(start, ooo[i].start)) ooo[i].start = start;
+        if (SEQ_GT(end, ooo[i].end)) ooo[i].end = end;
+        
+        // Absorb following ranges the grown one now reaches
+        int j = i + 1;
+        while (j < n && SEQ_LEQ(ooo[j].start, ooo[i].end)) {
+            if (SEQ_GT(ooo[j].end, ooo[i].end)) ooo[i].end = ooo[j].end;
+            j++;
+        }
+        memmove(&ooo[i + 1], &ooo[j], (n - j) * sizeof(tcp_seq_range_t));
+        sock->ooo_count = n - (j - i - 1);
+        return 0;
+    }
+    
+    if (n == TCP_MAX_OOO_RANGES) {
+        return -1;
+    }
+    memmove(&ooo[i + 1], &ooo[i], (n - i) * sizeof(tcp_seq_range_t));
+    ooo[i].start = start;
+    ooo[i].end = end;
+    sock->ooo_count = n + 1;
+    return 0;
 }
 
+// Hand everything on the transmit batch to the backend in one call, then
+// drop the packets' references on their payload
+static void tcp_tx_flush(tcp_stack_t *stack) {
+    if (stack->tx_count > 0) {
+        stack->backend->xmit(stack, stack->tx_batch, stack->tx_count);
+        for (int i = 0; i < stack->tx_count; i++) {
+            tcp_pktbuf_free(stack->tx_batch[i].pb);
+        }
+        stack->tx_count = 0;
+    }
+}
 
-// Send TCP packet
-static int send_tcp_packet(tcp_socket_t *sock, uint8_t flags, 
-                          const void *data, size_t data_len) {
-    char packet[sizeof(struct ip_header) + sizeof(struct tcp_header) + data_len];
-    struct ip_header *iph = (struct ip_header *)packet;
-    struct tcp_header *tcph = (struct tcp_header *)(packet + sizeof(struct ip_header));
+// Queue a TCP segment starting at sequence number seq on the transmit
+// batch, with the contents of pb (NULL = none) as its payload. The packet
+// takes a reference on pb rather than a copy, so releasing the buffer
+// before the next tcp_tx_flush() is safe. When nothing else holds pb the
+// headers are built in its headroom and the packet goes out in one piece.
+// Returns the packet length.
+static int send_tcp_segment(tcp_socket_t *sock, uint32_t seq, uint8_t flags,
+                            tcp_pktbuf_t *pb) {
+    tcp_stack_t *stack = sock->stack;
+    if (stack->tx_count == TCP_TX_BATCH) {
+        tcp_tx_flush(stack);
+    }
+    
+    tcp_pkt_t *pkt = &stack->tx_batch[stack->tx_count];
+    const uint8_t *data = pb ? pb->data : NULL;
+    size_t data_len = pb ? pb->len : 0;
+    
+    uint8_t opts[40];
+    int opt_len = tcp_write_options(sock, flags, data_len, opts);
+    size_t tcp_hdr_len = sizeof(struct tcp_header) + opt_len;
+    size_t hdr_len = sizeof(struct ip_header) + tcp_hdr_len;
+    size_t tcp_len = tcp_hdr_len + data_len;
+    
+    sock->segs_out++;
+    sock->bytes_sent += data_len;
+    TCP_MIB_INC(stack, out_segs);
+    
+    // A queued packet holding pb may still be reading in front of its data
+    uint8_t *hdr = pkt->hdr;
+    if (pb && pb->refs == 1 && tcp_pktbuf_headroom(pb) >= hdr_len) {
+        hdr = pb->data - hdr_len;
+    }
+    struct ip_header *iph = (struct ip_header *)hdr;
+    struct tcp_header *tcph = (struct tcp_header *)(hdr + sizeof(struct ip_header));
     
     // Clear packet
-    memset(packet, 0, sizeof(struct ip_header) + sizeof(struct tcp_header));
+    memset(hdr, 0, sizeof(struct ip_header) + sizeof(struct tcp_header));
+    memcpy((uint8_t *)tcph + sizeof(struct tcp_header), opts, opt_len);
     
     // Fill IP header
     iph->version_ihl = 0x45;  // IPv4, IHL = 5 (20 bytes)
     iph->tos = 0;
-    iph->total_length = htons(sizeof(struct ip_header) + sizeof(struct tcp_header) + data_len);
-    iph->id = htons(rand() % 65536);
+    iph->total_length = htons(sizeof(struct ip_header) + tcp_len);
+    iph->id = htons(stack->ip_id++);
     iph->frag_offset = 0;
     iph->ttl = 64;
     iph->protocol = IPPROTO_TCP;
@@ -92,485 +574,2832 @@ static int send_tcp_packet(tcp_socket_t *sock, uint8_t flags,
     // Fill TCP header
     tcph->src_port = sock->local_addr.sin_port;
     tcph->dst_port = sock->remote_addr.sin_port;
-    tcph->seq_num = htonl(sock->send_seq);
+    tcph->seq_num = htonl(seq);
     tcph->ack_num = htonl(sock->recv_seq);
-    tcph->data_offset = 0x50;  // 5 * 4 = 20 bytes
+    tcph->data_offset = (tcp_hdr_len / 4) << 4;
     tcph->flags = flags;
-    tcph->window = htons(TCP_WINDOW_SIZE);
+    tcph->window = htons(tcp_window_field(sock, flags));
     tcph->checksum = 0;
     tcph->urgent_ptr = 0;
     
-    // Copy data if any
-    if (data_len > 0 && data != NULL) {
-        memcpy(packet + sizeof(struct ip_header) + sizeof(struct tcp_header), 
-               data, data_len);
+    if (!(flags & TCP_SYN)) {
+        sock->rcv_adv = sock->recv_seq + ((uint32_t)ntohs(tcph->window) << sock->rcv_wscale);
+    }
+    
+    // Every segment carrying an ACK covers whatever ACK was being delayed
+    if (flags & TCP_ACK) {
+        sock->ack_pending = 0;
+        tcp_clear_timer(sock, TCP_TIMER_DELACK);
+    }
+    
+    // Calculate TCP checksum: the pseudo header is summed arithmetically,
+    // then the header (always an even length) and the payload are chained
+    uint32_t sum = tcp_csum_pseudo(iph->src_addr, iph->dst_addr, IPPROTO_TCP, tcp_len);
+    sum = tcp_csum_partial(tcph, tcp_hdr_len, sum);
+    sum = tcp_csum_partial(data, data_len, sum);
+    tcph->checksum = tcp_csum_fold(sum);
+    
+    pkt->iov[0].iov_base = hdr;
+    if (hdr != pkt->hdr) {
+        pkt->iov[0].iov_len = hdr_len + data_len;
+        pkt->iovcnt = 1;
+    } else {
+        pkt->iov[0].iov_len = hdr_len;
+        pkt->iov[1].iov_base = (void *)data;
+        pkt->iov[1].iov_len = data_len;
+        pkt->iovcnt = data_len > 0 ? 2 : 1;
+    }
+    pkt->dst_addr = iph->dst_addr;
+    pkt->pb = pb ? tcp_pktbuf_ref(pb) : NULL;
+    
+    // Send packet
+    stack->tx_count++;
+    
+    return sizeof(struct ip_header) + tcp_len;
+}
+
+// Send TCP packet at the next send sequence number
+static int send_tcp_packet(tcp_socket_t *sock, uint8_t flags, tcp_pktbuf_t *pb) {
+    return send_tcp_segment(sock, sock->snd_nxt, flags, pb);
+}
+
+// Sequence space consumed by a segment (SYN and FIN count as one byte each)
+static uint32_t tcp_seg_seqlen(uint8_t flags, uint32_t data_len) {
+    return data_len + ((flags & TCP_SYN) ? 1 : 0) + ((flags & TCP_FIN) ? 1 : 0);
+}
+
+// Restart the retransmission timer, or stop it when nothing is outstanding
+static void tcp_rearm_rto(tcp_socket_t *sock) {
+    if (sock->rtx_head) {
+        tcp_set_timer(sock, TCP_TIMER_RTO, sock->rto_ms);
+    } else {
+        tcp_clear_timer(sock, TCP_TIMER_RTO);
+    }
+}
+
+// Update SRTT/RTTVAR from a round-trip sample and recompute the RTO (RFC 6298)
+static void tcp_rtt_sample(tcp_socket_t *sock, uint32_t rtt_us) {
+    if (rtt_us == 0) {
+        rtt_us = 1;
+    }
+    
+    if (sock->srtt_us == 0) {
+        sock->srtt_us = rtt_us;
+        sock->rttvar_us = rtt_us / 2;
+    } else {
+        uint32_t delta = rtt_us > sock->srtt_us ? rtt_us - sock->srtt_us
+                                                : sock->srtt_us - rtt_us;
+        sock->rttvar_us = (3 * sock->rttvar_us + delta) / 4;
+        sock->srtt_us = (7 * sock->srtt_us + rtt_us) / 8;
+    }
+    
+    uint32_t rto = (sock->srtt_us + 4 * sock->rttvar_us) / 1000;
+    if (rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+    if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+    sock->rto_ms = rto;
+}
+
+_Static_assert(sizeof(tcp_segment_t) <= sizeof(((tcp_pktbuf_t *)0)->cb),
+               "tcp_segment_t must fit in a packet buffer's control area");
+
+// Retransmission-queue entry for a segment about to be sent at snd_nxt,
+// in a pool buffer sized for the payload; the caller fills in the
+// payload at seg->pb->data
+static tcp_segment_t *tcp_segment_alloc(tcp_socket_t *sock, uint8_t flags, size_t data_len) {
+    tcp_pktbuf_t *pb = tcp_pktbuf_alloc(&sock->stack->pktpool, data_len);
+    if (!pb) {
+        return NULL;
+    }
+    tcp_pktbuf_put(pb, data_len);
+    
+    tcp_segment_t *seg = (tcp_segment_t *)pb->cb;
+    seg->next = NULL;
+    seg->pb = pb;
+    seg->seq = sock->snd_nxt;
+    seg->len = data_len;
+    seg->flags = flags;
+    seg->retransmits = 0;
+    seg->sacked = 0;
+    seg->lost = 0;
+    seg->sent_us = 0;
+    return seg;
+}
+
+// Send a segment from its queue copy and append it to the retransmission queue
+static int tcp_segment_xmit(tcp_socket_t *sock, tcp_segment_t *seg) {
+    seg->sent_us = tcp_now_us();
+    if (send_tcp_packet(sock, seg->flags, seg->pb) < 0) {
+        tcp_pktbuf_free(seg->pb);
+        return -1;
+    }
+    
+    if (sock->rtx_tail) {
+        sock->rtx_tail->next = seg;
+    } else {
+        sock->rtx_head = seg;
+    }
+    sock->rtx_tail = seg;
+    if (!sock->sack_hole) {
+        sock->sack_hole = seg;
+    }
+    sock->snd_nxt += tcp_seg_seqlen(seg->flags, seg->len);
+    
+    if (!tcp_timer_pending(&sock->timers[TCP_TIMER_RTO])) {
+        tcp_rearm_rto(sock);
+    }
+    
+    return 0;
+}
+
+// Send a SYN or FIN, which occupies sequence space, and keep it for
+// retransmission
+static int tcp_output_segment(tcp_socket_t *sock, uint8_t flags) {
+    tcp_segment_t *seg = tcp_segment_alloc(sock, flags, 0);
+    if (!seg) {
+        return -1;
+    }
+    return tcp_segment_xmit(sock, seg);
+}
+
+// Resend a segment from the retransmission queue
+static void tcp_retransmit(tcp_socket_t *sock, tcp_segment_t *seg) {
+    seg->retransmits++;
+    sock->retrans_segs++;
+    sock->bytes_retrans += seg->len;
+    TCP_MIB_INC(sock->stack, retrans_segs);
+    seg->sent_us = tcp_now_us();
+    send_tcp_segment(sock, seg->seq, seg->flags, seg->pb);
+}
+
+// Release every segment on the retransmission queue
+static void tcp_free_rtx_queue(tcp_socket_t *sock) {
+    while (sock->rtx_head) {
+        tcp_segment_t *seg = sock->rtx_head;
+        sock->rtx_head = seg->next;
+        tcp_pktbuf_free(seg->pb);
+    }
+    sock->rtx_tail = NULL;
+    sock->sack_hole = NULL;
+    sock->rxt_hint = NULL;
+    sock->sacked_bytes = sock->sacked_segs = 0;
+    sock->hole_sacked_bytes = sock->hole_sacked_segs = 0;
+    sock->lost_bytes = sock->rxt_bytes = 0;
+    tcp_clear_timer(sock, TCP_TIMER_RTO);
+}
+
+// Usable congestion and flow control window
+static uint32_t tcp_send_window(const tcp_socket_t *sock) {
+    return sock->cwnd < sock->snd_wnd ? sock->cwnd : sock->snd_wnd;
+}
+
+// A hole is deemed lost once DupThresh segments, or more than
+// (DupThresh - 1) * MSS bytes, above it have been SACKed (RFC 6675 IsLost)
+static int tcp_sack_is_lost(const tcp_socket_t *sock, uint32_t sacked_segs, uint32_t sacked_bytes) {
+    return sacked_segs >= TCP_DUPACK_THRESHOLD ||
+           sacked_bytes > (TCP_DUPACK_THRESHOLD - 1) * (uint32_t)sock->mss;
+}
+
+// Move the hole cursor past SACKed segments and the holes the SACKed data
+// above them now marks lost. SACKs only accumulate, so a lost hole stays
+// lost and every segment is passed once.
+static void tcp_sack_advance(tcp_socket_t *sock) {
+    tcp_segment_t *seg;
+    while ((seg = sock->sack_hole) != NULL) {
+        uint32_t len = tcp_seg_seqlen(seg->flags, seg->len);
+        if (seg->sacked) {
+            sock->hole_sacked_bytes -= len;
+            sock->hole_sacked_segs--;
+        } else if (tcp_sack_is_lost(sock, sock->hole_sacked_segs, sock->hole_sacked_bytes)) {
+            seg->lost = 1;
+            sock->lost_bytes += len;
+        } else {
+            break;
+        }
+        sock->sack_hole = seg->next;
+    }
+}
+
+// Take len bytes at the front of seg, the oldest segment, off the scoreboard
+// as the cumulative ACK passes them
+static void tcp_sack_acked(tcp_socket_t *sock, const tcp_segment_t *seg, uint32_t len) {
+    if (seg->sacked) {
+        sock->sacked_bytes -= len;
+        if (seg == sock->sack_hole) {
+            sock->hole_sacked_bytes -= len;
+        }
+        return;
+    }
+    if (seg->lost) {
+        sock->lost_bytes -= len;
+    }
+    if (SEQ_LT(seg->seq, sock->high_rxt)) {
+        sock->rxt_bytes -= len;
+    }
+}
+
+// Mark queued segments that the peer's SACK blocks report as received.
+// Returns 1 if any segment was newly SACKed.
+static int tcp_sack_update(tcp_socket_t *sock, const struct tcp_opts *opts, uint32_t ack) {
+    int newly = 0;
+    
+    for (int i = 0; i < opts->sack_count; i++) {
+        uint32_t start = opts->sack[i].start;
+        uint32_t end = opts->sack[i].end;
+        
+        // Ignore blocks below the cumulative ACK or beyond what we sent
+        if (SEQ_GEQ(start, end) || SEQ_LEQ(end, ack) || SEQ_GT(end, sock->snd_nxt)) {
+            continue;
+        }
+        
+        for (tcp_segment_t *seg = sock->rtx_head; seg && SEQ_LT(seg->seq, end); seg = seg->next) {
+            uint32_t len = tcp_seg_seqlen(seg->flags, seg->len);
+            if (seg->sacked || SEQ_LT(seg->seq, start) || SEQ_GT(seg->seq + len, end)) {
+                continue;
+            }
+            
+            // Unsacked segments below the cursor are exactly the lost ones
+            seg->sacked = 1;
+            sock->sacked_bytes += len;
+            sock->sacked_segs++;
+            if (seg->lost) {
+                sock->lost_bytes -= len;
+            } else {
+                sock->hole_sacked_bytes += len;
+                sock->hole_sacked_segs++;
+            }
+            if (SEQ_LT(seg->seq, sock->high_rxt)) {
+                sock->rxt_bytes -= len;
+            }
+            newly = 1;
+        }
+    }
+    
+    if (newly) {
+        tcp_sack_advance(sock);
+    }
+    return newly;
+}
+
+// Bytes estimated to be in the network (RFC 6675 pipe): what is outstanding
+// less what was SACKed or deemed lost, plus the holes resent in this
+// recovery
+static uint32_t tcp_sack_pipe(const tcp_socket_t *sock) {
+    return sock->snd_nxt - sock->snd_una - sock->sacked_bytes - sock->lost_bytes + sock->rxt_bytes;
+}
+
+// First lost hole not yet resent in this recovery, or NULL. Lost holes all
+// lie below the cursor and are resent in order, so the search resumes where
+// the last one stopped.
+static tcp_segment_t *tcp_sack_next_hole(tcp_socket_t *sock) {
+    tcp_segment_t *seg = sock->rxt_hint ? sock->rxt_hint : sock->rtx_head;
+    while (seg != sock->sack_hole && (seg->sacked || SEQ_LT(seg->seq, sock->high_rxt))) {
+        seg = seg->next;
+    }
+    sock->rxt_hint = seg;
+    return seg != sock->sack_hole ? seg : NULL;
+}
+
+// Whether the oldest unacknowledged segment is deemed lost by the scoreboard
+static int tcp_sack_head_lost(const tcp_socket_t *sock) {
+    return sock->rtx_head && sock->rtx_head->lost && !sock->rtx_head->sacked;
+}
+
+// Resend lost holes while the pipe leaves room in the congestion window
+// (RFC 6675 NextSeg rule 1); SACKed data is never sent again
+static void tcp_sack_output(tcp_socket_t *sock) {
+    tcp_segment_t *seg;
+    
+    while (tcp_sack_pipe(sock) < sock->cwnd && (seg = tcp_sack_next_hole(sock)) != NULL) {
+        uint32_t len = tcp_seg_seqlen(seg->flags, seg->len);
+        tcp_retransmit(sock, seg);
+        sock->high_rxt = seg->seq + len;
+        sock->rxt_bytes += len;
+    }
+}
+
+// Bytes of new data the congestion and flow control windows allow now.
+// During SACK recovery the pipe estimate stands in for the data in flight.
+static uint32_t tcp_send_room(const tcp_socket_t *sock) {
+    uint32_t outstanding = sock->snd_nxt - sock->snd_una;
+    uint32_t in_flight = outstanding;
+    
+    if (sock->in_recovery && sock->sack_ok) {
+        in_flight = tcp_sack_pipe(sock);
+    }
+    
+    if (in_flight >= sock->cwnd || outstanding >= sock->snd_wnd) {
+        return 0;
+    }
+    
+    uint32_t room = sock->cwnd - in_flight;
+    return room < sock->snd_wnd - outstanding ? room : sock->snd_wnd - outstanding;
+}
+
+// Fast retransmit: the oldest segment was lost. Stay in fast recovery until
+// everything sent so far is acknowledged.
+static void tcp_enter_recovery(tcp_socket_t *sock) {
+    tcp_segment_t *head = sock->rtx_head;
+    
+    sock->recover = sock->snd_nxt;
+    sock->in_recovery = 1;
+    sock->cc->on_loss(sock);
+    tcp_retransmit(sock, head);
+    
+    if (sock->sack_ok) {
+        // The pipe rather than window inflation paces SACK recovery
+        sock->cwnd = sock->ssthresh;
+        sock->high_rxt = head->seq + tcp_seg_seqlen(head->flags, head->len);
+        sock->rxt_bytes = head->sacked ? 0 : tcp_seg_seqlen(head->flags, head->len);
+        sock->rxt_hint = head;
+        tcp_sack_output(sock);
+    }
+    
+    tcp_rearm_rto(sock);
+}
+
+// Data is waiting but the peer's window is closed and nothing is in flight
+// to draw the ACK that reopens it: probe the window until it does
+static void tcp_update_persist(tcp_socket_t *sock) {
+    if (sock->snd_len > 0 && sock->snd_wnd == 0 && !sock->rtx_head) {
+        if (!tcp_timer_pending(&sock->timers[TCP_TIMER_PERSIST])) {
+            sock->persist_ms = sock->rto_ms;
+            sock->persist_probes = 0;
+            tcp_set_timer(sock, TCP_TIMER_PERSIST, sock->persist_ms);
+        }
+    } else {
+        tcp_clear_timer(sock, TCP_TIMER_PERSIST);
+    }
+}
+
+// Send buffered data as far as the congestion and flow control windows
+// allow. Segments resent after an RTO go first. Returns -1 if a segment
+// could not be sent.
+static int tcp_output(tcp_socket_t *sock) {
+    while (sock->snd_len > 0 && !sock->rxt_active) {
+        uint32_t room = tcp_send_room(sock);
+        if (room == 0) {
+            break;
+        }
+        
+        uint32_t chunk_size = sock->snd_len < sock->mss ? sock->snd_len : sock->mss;
+        if (chunk_size > room) {
+            chunk_size = room;
+        }
+        
+        // Coalesce small writes: a short segment waits while corked, or
+        // under Nagle's algorithm while the previous short one is
+        // unacknowledged (so the tail of a bulk write is not held up); the
+        // ACK that clears it comes back here with more bytes buffered. A
+        // FIN waiting behind the data pushes everything out.
+        if (chunk_size < sock->mss && !sock->fin_queued) {
+            if (sock->cork || (!sock->nodelay && SEQ_GT(sock->snd_sml, sock->snd_una))) {
+                break;
+            }
+            sock->snd_sml = sock->snd_nxt + chunk_size;
+        }
+        
+        // Push the last buffered bytes to the application (RFC 9293 3.9.1)
+        uint8_t flags = chunk_size == sock->snd_len ? TCP_PSH | TCP_ACK : TCP_ACK;
+        
+        // Copy straight from the send ring into the retransmission queue;
+        // the segment is sent from there
+        tcp_segment_t *seg = tcp_segment_alloc(sock, flags, chunk_size);
+        if (!seg) {
+            return -1;
+        }
+        uint32_t first = sock->sndbuf_size - sock->snd_head;
+        if (first > chunk_size) {
+            first = chunk_size;
+        }
+        memcpy(seg->pb->data, sock->send_buffer + sock->snd_head, first);
+        memcpy(seg->pb->data + first, sock->send_buffer, chunk_size - first);
+        if (tcp_segment_xmit(sock, seg) < 0) {
+            return -1;
+        }
+        
+        sock->snd_head = (sock->snd_head + chunk_size) % sock->sndbuf_size;
+        sock->snd_len -= chunk_size;
+    }
+    
+    // The FIN of a non-blocking close goes out behind the last byte
+    if (sock->fin_queued && sock->snd_len == 0) {
+        sock->fin_queued = 0;
+        printf("Sending FIN...\n");
+        if (tcp_output_segment(sock, TCP_FIN | TCP_ACK) < 0) {
+            return -1;
+        }
+    }
+    
+    tcp_update_persist(sock);
+    return 0;
+}
+
+// After an RTO everything that was in flight is presumed lost: resend it in
+// order as the (collapsed) congestion window allows
+static void tcp_resend_lost(tcp_socket_t *sock) {
+    while (sock->rxt_active) {
+        if (SEQ_LT(sock->rxt_next, sock->snd_una)) {
+            sock->rxt_next = sock->snd_una;
+        }
+        if (SEQ_GEQ(sock->rxt_next, sock->recover) || !sock->rtx_head) {
+            sock->rxt_active = 0;
+            break;
+        }
+        if (sock->rxt_next - sock->snd_una >= tcp_send_window(sock)) {
+            break;
+        }
+        
+        tcp_segment_t *seg = sock->rtx_head;
+        while (seg && (seg->sacked ||
+                       SEQ_LEQ(seg->seq + tcp_seg_seqlen(seg->flags, seg->len), sock->rxt_next))) {
+            seg = seg->next;
+        }
+        if (!seg) {
+            sock->rxt_active = 0;
+            break;
+        }
+        
+        tcp_retransmit(sock, seg);
+        sock->rxt_next = seg->seq + tcp_seg_seqlen(seg->flags, seg->len);
+    }
+}
+
+// Retransmission timer expired: resend the oldest segment and back off
+static int tcp_rto_expired(tcp_socket_t *sock) {
+    tcp_segment_t *seg = sock->rtx_head;
+    
+    if (seg->retransmits >= TCP_MAX_RETRIES) {
+        printf("Retransmission limit reached, dropping connection\n");
+        tcp_free_rtx_queue(sock);
+        sock->state = TCP_CLOSED;
+        sock->so_error = ETIMEDOUT;
+        return -1;
+    }
+    
+    // Collapse the congestion window and go back to the oldest segment
+    sock->timeouts++;
+    TCP_MIB_INC(sock->stack, timeouts);
+    sock->cc->on_rto(sock);
+    sock->in_recovery = 0;
+    sock->recover = sock->snd_nxt;
+    
+    tcp_retransmit(sock, seg);
+    sock->rxt_next = seg->seq + tcp_seg_seqlen(seg->flags, seg->len);
+    sock->rxt_active = SEQ_LT(sock->rxt_next, sock->recover);
+    
+    sock->rto_ms = sock->rto_ms * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : sock->rto_ms * 2;
+    sock->dupacks = 0;
+    tcp_rearm_rto(sock);
+    
+    return 0;
+}
+
+// Hash bucket for a connection's 4-tuple (addresses and ports in network order)
+static uint32_t tcp_hash(uint32_t laddr, uint16_t lport, uint32_t raddr, uint16_t rport) {
+    uint32_t h = laddr ^ (raddr * 0x9E3779B1u) ^ (((uint32_t)lport << 16) | rport);
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return h & (TCP_HASH_SIZE - 1);
+}
+
+// Bucket a socket lives in: listeners by local port, connections by 4-tuple
+static tcp_socket_t **tcp_hash_chain(const tcp_socket_t *sock) {
+    if (sock->listening) {
+        return &sock->stack->listen_hash[ntohs(sock->local_addr.sin_port) & (TCP_HASH_SIZE - 1)];
+    }
+    return &sock->stack->conn_hash[tcp_hash(sock->local_addr.sin_addr.s_addr, sock->local_addr.sin_port,
+                                           sock->remote_addr.sin_addr.s_addr, sock->remote_addr.sin_port)];
+}
+
+// Make a socket reachable by the RX dispatcher. Its addresses must not
+// change until it is removed again.
+static void tcp_hash_insert(tcp_socket_t *sock) {
+    tcp_socket_t **chain = tcp_hash_chain(sock);
+    sock->hash_next = *chain;
+    *chain = sock;
+    sock->hashed = 1;
+}
+
+static void tcp_hash_remove(tcp_socket_t *sock) {
+    if (!sock->hashed) {
+        return;
+    }
+    
+    for (tcp_socket_t **p = tcp_hash_chain(sock); *p; p = &(*p)->hash_next) {
+        if (*p == sock) {
+            *p = sock->hash_next;
+            break;
+        }
+    }
+    sock->hashed = 0;
+}
+
+// Control block for an incoming segment: the connection with its exact
+// 4-tuple, otherwise a listener on the destination port
+static tcp_socket_t *tcp_lookup(const tcp_stack_t *stack, uint32_t saddr, uint16_t sport,
+                                uint32_t daddr, uint16_t dport) {
+    for (tcp_socket_t *s = stack->conn_hash[tcp_hash(daddr, dport, saddr, sport)]; s; s = s->hash_next) {
+        if (s->local_addr.sin_port == dport && s->remote_addr.sin_port == sport &&
+            s->local_addr.sin_addr.s_addr == daddr && s->remote_addr.sin_addr.s_addr == saddr) {
+            return s;
+        }
+    }
+    
+    for (tcp_socket_t *s = stack->listen_hash[ntohs(dport) & (TCP_HASH_SIZE - 1)]; s; s = s->hash_next) {
+        if (s->local_addr.sin_port == dport &&
+            (s->local_addr.sin_addr.s_addr == INADDR_ANY || s->local_addr.sin_addr.s_addr == daddr)) {
+            return s;
+        }
+    }
+    
+    return NULL;
+}
+
+// Shard that owns a flow, from the addresses and ports (network order) of
+// a packet in either direction: a symmetric hash of the 4-tuple, so both
+// ends of a link between sharded stacks agree. The backends evaluate the
+// same hash in the kernel to steer received packets.
+int tcp_flow_shard(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport, int shards) {
+    uint32_t h = ntohl(saddr ^ daddr) ^ (ntohs(sport) ^ ntohs(dport));
+    h *= 0x9E3779B1u;
+    h ^= h >> 16;
+    return shards > 1 ? (int)(h % shards) : 0;
+}
+
+// Packets of sock's connection from local port lport reach its own stack
+static int tcp_flow_ours(const tcp_socket_t *sock, uint16_t lport) {
+    const tcp_stack_t *stack = sock->stack;
+    return stack->shards <= 1 ||
+           tcp_flow_shard(sock->remote_addr.sin_addr.s_addr, sock->remote_addr.sin_port,
+                          sock->local_addr.sin_addr.s_addr, lport, stack->shards) == stack->shard;
+}
+
+// Give a connection that was never bound a free ephemeral port, starting
+// the search at a random one. A shard only takes ports whose flow hashes
+// to it. Returns -1 with errno set if all are taken.
+static int tcp_pick_port(tcp_socket_t *sock) {
+    const int count = 65536 - TCP_PORT_EPHEMERAL;
+    int start = tcp_random(sock->stack) % count;
+    
+    for (int i = 0; i < count; i++) {
+        uint16_t port = htons(TCP_PORT_EPHEMERAL + (start + i) % count);
+        if (!tcp_flow_ours(sock, port)) {
+            continue;
+        }
+        if (!tcp_lookup(sock->stack, sock->remote_addr.sin_addr.s_addr, sock->remote_addr.sin_port,
+                        sock->local_addr.sin_addr.s_addr, port)) {
+            sock->local_addr.sin_port = port;
+            return 0;
+        }
+    }
+    
+    errno = EADDRNOTAVAIL;
+    return -1;
+}
+
+// Parse a received IPv4 packet and find its control block in the stack
+// (*owner is NULL if it is not for us). flags are the backend's TCP_RX_*.
+static void tcp_rx_parse(tcp_stack_t *stack, const uint8_t *pkt, int len, int flags,
+                         struct tcp_rx_seg *seg, tcp_socket_t **owner) {
+    *owner = NULL;
+    
+    // A TUN device carries every protocol, not just TCP
+    const struct ip_header *iph = (const struct ip_header *)pkt;
+    if (len < (int)sizeof(struct ip_header) || (iph->version_ihl >> 4) != 4 ||
+        iph->protocol != IPPROTO_TCP) {
+        TCP_MIB_INC(stack, in_discards);
+        return;
+    }
+    int ip_header_len = (iph->version_ihl & 0x0F) * 4;
+    
+    // Frames from the packet ring may carry link-layer padding
+    int ip_len = ntohs(iph->total_length);
+    if (ip_len >= ip_header_len && ip_len < len) {
+        len = ip_len;
+    }
+    
+    if (len < (int)(ip_header_len + sizeof(struct tcp_header))) {
+        TCP_MIB_INC(stack, in_errs);
+        return;  // Packet too small
+    }
+    
+    const struct tcp_header *recv_tcph = (const struct tcp_header *)(pkt + ip_header_len);
+    int tcp_header_len = (recv_tcph->data_offset >> 4) * 4;
+    
+    if (tcp_header_len < (int)sizeof(struct tcp_header) ||
+        len < ip_header_len + tcp_header_len) {
+        TCP_MIB_INC(stack, in_errs);
+        return;  // Malformed header
+    }
+    
+    // Verify the checksum unless the kernel already has. A packet it sent
+    // over lo or a veth pair may still carry only the pseudo header sum it
+    // leaves to offload; that is taken on trust where the backend says so.
+    int tcp_len = len - ip_header_len;
+    if (!(flags & TCP_RX_CSUM_VALID)) {
+        uint32_t pseudo = tcp_csum_pseudo(iph->src_addr, iph->dst_addr, IPPROTO_TCP, tcp_len);
+        uint16_t offload = ~tcp_csum_fold(pseudo);
+        if (tcp_csum_fold(tcp_csum_partial(recv_tcph, tcp_len, pseudo)) != 0 &&
+            !((flags & TCP_RX_CSUM_PARTIAL) && recv_tcph->checksum == offload)) {
+            TCP_MIB_INC(stack, in_csum_errs);
+            return;
+        }
+    }
+    
+    *owner = tcp_lookup(stack, iph->src_addr, recv_tcph->src_port, iph->dst_addr, recv_tcph->dst_port);
+    if (!*owner) {
+        TCP_MIB_INC(stack, in_no_socket);
+        return;
+    }
+    
+    memcpy(&seg->hdr, recv_tcph, sizeof(struct tcp_header));
+    tcp_parse_options((const uint8_t *)recv_tcph + sizeof(struct tcp_header),
+                      tcp_header_len - sizeof(struct tcp_header), &seg->opts);
+    seg->src_addr = iph->src_addr;
+    seg->dst_addr = iph->dst_addr;
+    seg->data = pkt + ip_header_len + tcp_header_len;
+    seg->data_len = len - ip_header_len - tcp_header_len;
+}
+
+// Initial congestion window for the negotiated MSS (RFC 6928)
+static uint32_t tcp_initial_cwnd(uint32_t mss) {
+    uint32_t iw = 2 * mss > 14600 ? 2 * mss : 14600;
+    return 10 * mss < iw ? 10 * mss : iw;
+}
+
+// Ask the kernel for its route to daddr: the source address it picks and
+// the MSS the outgoing interface's MTU allows. Returns -1 without a route.
+static int tcp_route_query(uint32_t daddr, tcp_route_t *rt) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_in dst = { .sin_family = AF_INET, .sin_addr.s_addr = daddr };
+    if (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    struct sockaddr_in src;
+    socklen_t len = sizeof(src);
+    rt->saddr = getsockname(fd, (struct sockaddr *)&src, &len) == 0 ? src.sin_addr.s_addr : INADDR_ANY;
+    
+    int mtu;
+    len = sizeof(mtu);
+    rt->adv_mss = TCP_MSS;
+    if (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 &&
+        mtu > (int)(sizeof(struct ip_header) + sizeof(struct tcp_header))) {
+        int mss = mtu - sizeof(struct ip_header) - sizeof(struct tcp_header);
+        rt->adv_mss = mss > TCP_MSS_MAX ? TCP_MSS_MAX : mss;
+    }
+    
+    close(fd);
+    return 0;
+}
+
+// Find the route to the peer: fill in an unbound local address and derive
+// the MSS we advertise from the outgoing interface's MTU. A stack with an
+// address of its own owns its link, so the kernel is not asked. Otherwise
+// its answer is remembered per peer for TCP_ROUTE_TTL, so a burst of SYNs
+// or connects costs one lookup rather than five system calls each.
+static void tcp_route_lookup(tcp_socket_t *sock) {
+    tcp_stack_t *stack = sock->stack;
+    sock->adv_mss = TCP_MSS;
+    
+    if (stack->addr != INADDR_ANY) {
+        if (sock->local_addr.sin_addr.s_addr == INADDR_ANY) {
+            sock->local_addr.sin_addr.s_addr = stack->addr;
+        }
+        int mss = stack->mtu - sizeof(struct ip_header) - sizeof(struct tcp_header);
+        sock->adv_mss = mss > TCP_MSS_MAX ? TCP_MSS_MAX : mss;
+        return;
+    }
+    
+    uint32_t daddr = sock->remote_addr.sin_addr.s_addr;
+    tcp_route_t *rt = &stack->routes[((daddr * 0x9E3779B1u) >> 16) & (TCP_ROUTE_CACHE - 1)];
+    uint64_t now = tcp_now_ms();
+    if (rt->daddr != daddr || now >= rt->expires) {
+        if (tcp_route_query(daddr, rt) < 0) {
+            rt->expires = 0;
+            return;
+        }
+        rt->daddr = daddr;
+        rt->expires = now + TCP_ROUTE_TTL;
+    }
+    
+    if (sock->local_addr.sin_addr.s_addr == INADDR_ANY) {
+        sock->local_addr.sin_addr.s_addr = rt->saddr;
+    }
+    sock->adv_mss = rt->adv_mss;
+}
+
+// Adopt the options the peer sent on its SYN or SYN-ACK
+static void tcp_negotiate_options(tcp_socket_t *sock, const struct tcp_opts *opts) {
+    sock->ws_ok = opts->wscale >= 0;
+    if (sock->ws_ok) {
+        sock->snd_wscale = opts->wscale;
+    } else {
+        sock->snd_wscale = 0;
+        sock->rcv_wscale = 0;
+    }
+    
+    sock->sack_ok = opts->sack_perm;
+    sock->ts_ok = opts->ts_present;
+    if (sock->ts_ok) {
+        sock->ts_recent = opts->ts_val;
+    }
+    
+    // Send no more than the peer accepts, leaving room for the timestamp option.
+    // A tiny MSS option is raised to TCP_MSS_MIN so segments still carry data.
+    uint16_t peer_mss = opts->mss ? opts->mss : TCP_MSS_DEFAULT;
+    if (peer_mss < TCP_MSS_MIN) {
+        peer_mss = TCP_MSS_MIN;
+    }
+    sock->mss = peer_mss < sock->adv_mss ? peer_mss : sock->adv_mss;
+    if (sock->ts_ok) {
+        sock->mss -= TCP_OPTLEN_TIMESTAMP;
+    }
+    sock->cwnd = tcp_initial_cwnd(sock->mss);
+}
+
+// Take the peer's window from a segment unless an older one arrived late
+// (RFC 793: SND.WL1 and SND.WL2). Returns 1 if the window grew.
+static int tcp_update_window(tcp_socket_t *sock, const struct tcp_rx_seg *rx, uint32_t ack, uint32_t wnd) {
+    uint32_t seq = ntohl(rx->hdr.seq_num);
+    if (sock->state != TCP_SYN_SENT &&
+        !SEQ_LT(sock->snd_wl1, seq) &&
+        !(sock->snd_wl1 == seq && SEQ_LEQ(sock->snd_wl2, ack))) {
+        return 0;
+    }
+    
+    int opened = wnd > sock->snd_wnd;
+    sock->snd_wnd = wnd;
+    sock->snd_wl1 = seq;
+    sock->snd_wl2 = ack;
+    return opened;
+}
+
+// Process the acknowledgment and window fields of an incoming segment.
+// Returns 1 if the segment opened the send window (new data acked or window grew).
+static int tcp_process_ack(tcp_socket_t *sock, const struct tcp_rx_seg *rx) {
+    const struct tcp_header *tcph = &rx->hdr;
+    
+    if (!(tcph->flags & TCP_ACK)) {
+        return 0;
+    }
+    
+    uint32_t ack = ntohl(tcph->ack_num);
+    if (SEQ_LT(ack, sock->snd_una) || SEQ_GT(ack, sock->snd_nxt)) {
+        return 0;  // Old duplicate or acks data we never sent
+    }
+    
+    uint32_t wnd = (uint32_t)ntohs(tcph->window) << ((tcph->flags & TCP_SYN) ? 0 : sock->snd_wscale);
+    
+    if (ack == sock->snd_una) {
+        if (sock->sack_ok) {
+            tcp_sack_update(sock, &rx->opts, ack);
+        }
+        
+        // Duplicate ACK (RFC 5681): data outstanding, no payload, window unchanged
+        if (sock->rtx_head && rx->data_len == 0 && wnd == sock->snd_wnd &&
+            !(tcph->flags & (TCP_SYN | TCP_FIN))) {
+            sock->dupacks++;
+            sock->dupacks_in++;
+            
+            if (sock->in_recovery) {
+                if (sock->sack_ok) {
+                    tcp_sack_output(sock);
+                } else {
+                    // Each further duplicate ACK means a segment has left the network
+                    sock->cwnd += sock->mss;
+                }
+                return 1;
+            }
+            
+            // The segment after the duplicate ACK point was lost; with SACK the
+            // scoreboard can tell before the third duplicate arrives
+            if (SEQ_GT(ack, sock->recover) &&
+                (sock->dupacks == TCP_DUPACK_THRESHOLD ||
+                 (sock->sack_ok && tcp_sack_head_lost(sock)))) {
+                tcp_enter_recovery(sock);
+                return 1;
+            }
+        }
+        
+        return tcp_update_window(sock, rx, ack, wnd);
+    }
+    
+    uint32_t acked = ack - sock->snd_una;
+    sock->bytes_acked += acked;
+    
+    // Drop fully acknowledged segments, taking an RTT sample from the oldest
+    // one unless it was retransmitted (Karn's algorithm)
+    uint64_t now = tcp_now_us();
+    int sampled = 0;
+    while (sock->rtx_head) {
+        tcp_segment_t *seg = sock->rtx_head;
+        uint32_t end = seg->seq + tcp_seg_seqlen(seg->flags, seg->len);
+        
+        if (SEQ_GT(end, ack)) {
+            // Partially acknowledged: trim the acked bytes off the front
+            // (without moving them; a queued packet may still point there)
+            uint32_t acked = ack - seg->seq;
+            if (acked > 0 && acked <= seg->len) {
+                tcp_sack_acked(sock, seg, acked);
+                tcp_pktbuf_pull(seg->pb, acked);
+                seg->seq = ack;
+                seg->len -= acked;
+            }
+            break;
+        }
+        
+        if (!sampled && seg->retransmits == 0) {
+            tcp_rtt_sample(sock, (uint32_t)(now - seg->sent_us));
+            sampled = 1;
+        }
+        
+        tcp_sack_acked(sock, seg, end - seg->seq);
+        if (seg->sacked) {
+            sock->sacked_segs--;
+            if (seg == sock->sack_hole) {
+                sock->hole_sacked_segs--;
+            }
+        }
+        if (seg == sock->sack_hole) {
+            sock->sack_hole = seg->next;
+        }
+        if (seg == sock->rxt_hint) {
+            sock->rxt_hint = seg->next;
+        }
+        sock->rtx_head = seg->next;
+        tcp_pktbuf_free(seg->pb);
+    }
+    if (!sock->rtx_head) {
+        sock->rtx_tail = NULL;
+    }
+    
+    if (sock->sack_ok) {
+        tcp_sack_update(sock, &rx->opts, ack);
+    }
+    
+    // Otherwise the echoed timestamp gives a sample even for retransmitted data
+    if (!sampled && sock->ts_ok && rx->opts.ts_present && rx->opts.ts_ecr != 0) {
+        tcp_rtt_sample(sock, ((uint32_t)tcp_now_ms() - rx->opts.ts_ecr) * 1000);
+    }
+    
+    sock->snd_una = ack;
+    tcp_update_window(sock, rx, ack, wnd);
+    sock->dupacks = 0;
+    tcp_rearm_rto(sock);
+    
+    if (sock->in_recovery) {
+        if (SEQ_GEQ(ack, sock->recover)) {
+            // Full ACK: recovery is over, deflate the window
+            sock->in_recovery = 0;
+            sock->cwnd = sock->ssthresh;
+        } else if (sock->sack_ok) {
+            tcp_sack_output(sock);
+        } else if (sock->rtx_head) {
+            // Partial ACK: the next hole was lost too (RFC 6582)
+            tcp_retransmit(sock, sock->rtx_head);
+            sock->cwnd = sock->cwnd > acked ? sock->cwnd - acked : 0;
+            sock->cwnd += sock->mss;
+        }
+    } else {
+        sock->cc->on_ack(sock, acked);
+    }
+    
+    tcp_resend_lost(sock);
+    
+    return 1;
+}
+
+// Accept the payload of an incoming segment into the receive ring. In-order
+// bytes extend the readable data; early bytes are held until the gap fills.
+// Returns 1 if the segment simply extended the in-order data, 0 if it was a
+// duplicate, out of order or filled a gap (all of which are ACKed at once).
+static int tcp_queue_data(tcp_socket_t *sock, uint32_t seq,
+                           const uint8_t *data, uint32_t len) {
+    // Trim bytes we already have
+    if (SEQ_LT(seq, sock->recv_seq)) {
+        uint32_t dup = sock->recv_seq - seq;
+        if (dup >= len) {
+            return 0;
+        }
+        seq += dup;
+        data += dup;
+        len -= dup;
+    }
+    
+    // Trim bytes beyond the receive window
+    uint32_t space = sock->rcvbuf_size - sock->recv_len;
+    uint32_t off = seq - sock->recv_seq;
+    if (off >= space) {
+        TCP_MIB_INC(sock->stack, in_window_drops);
+        return 0;
+    }
+    if (len > space - off) {
+        len = space - off;
+    }
+    
+    // The ring is allocated with the first payload; without it the segment
+    // is dropped and the peer retransmits
+    if (sock->recv_buffer == NULL && (sock->recv_buffer = malloc(sock->rcvbuf_size)) == NULL) {
+        TCP_MIB_INC(sock->stack, in_window_drops);
+        return 0;
+    }
+    
+    if (off > 0) {
+        // With every range in use the bytes could not be tracked: drop
+        // them and let the peer retransmit once the gaps fill
+        if (tcp_ooo_insert(sock, seq, seq + len) < 0) {
+            TCP_MIB_INC(sock->stack, in_window_drops);
+            return 0;
+        }
+        tcp_rbuf_write(sock, sock->recv_len + off, data, len);
+        sock->sack_recent = seq;
+        sock->ooo_segs++;
+        return 0;
+    }
+    
+    tcp_rbuf_write(sock, sock->recv_len, data, len);
+    sock->recv_seq += len;
+    sock->recv_len += len;
+    sock->bytes_received += len;
+    
+    if (sock->ooo_count == 0) {
+        return 1;
+    }
+    
+    // The gap may now be filled: pull in contiguous out-of-order data
+    while (sock->ooo_count > 0 && SEQ_LEQ(sock->ooo[0].start, sock->recv_seq)) {
+        if (SEQ_GT(sock->ooo[0].end, sock->recv_seq)) {
+            sock->recv_len += sock->ooo[0].end - sock->recv_seq;
+            sock->bytes_received += sock->ooo[0].end - sock->recv_seq;
+            sock->recv_seq = sock->ooo[0].end;
+        }
+        sock->ooo_count--;
+        memmove(&sock->ooo[0], &sock->ooo[1], sock->ooo_count * sizeof(tcp_seq_range_t));
+    }
+    
+    return 0;
+}
+
+// Acknowledge in-order data lazily: at least every second full-sized
+// segment, otherwise when the delayed-ACK timer fires or the ACK can ride
+// on outgoing data
+static void tcp_ack_later(tcp_socket_t *sock, uint32_t len) {
+    sock->ack_pending += len;
+    
+    if (sock->ack_pending >= 2 * sock->mss) {
+        send_tcp_packet(sock, TCP_ACK, NULL);
+    } else if (!tcp_timer_pending(&sock->timers[TCP_TIMER_DELACK])) {
+        tcp_set_timer(sock, TCP_TIMER_DELACK, TCP_DELACK_TIMEOUT);
+    }
+}
+
+// Take a listener's connection off its SYN or accept queue
+static void tcp_child_unlink(tcp_socket_t *sock) {
+    tcp_socket_t *listen_sock = sock->parent;
+    tcp_socket_t **head = sock->accept_queued ? &listen_sock->accept_head : &listen_sock->syn_head;
+    tcp_socket_t *prev = NULL;
+    
+    for (tcp_socket_t *s = *head; s; prev = s, s = s->queue_next) {
+        if (s != sock) {
+            continue;
+        }
+        
+        if (prev) {
+            prev->queue_next = s->queue_next;
+        } else {
+            *head = s->queue_next;
+        }
+        
+        if (sock->accept_queued) {
+            if (listen_sock->accept_tail == sock) {
+                listen_sock->accept_tail = prev;
+            }
+            listen_sock->accept_qlen--;
+        } else {
+            listen_sock->syn_qlen--;
+        }
+        break;
+    }
+    
+    sock->queue_next = NULL;
+    sock->accept_queued = 0;
+}
+
+// A listener's connection completed its handshake: move it from the SYN
+// queue to the accept queue. Returns 0 if the accept queue is full, in
+// which case the handshake is left to complete on a later segment.
+static int tcp_child_established(tcp_socket_t *sock) {
+    tcp_socket_t *listen_sock = sock->parent;
+    
+    if (listen_sock->accept_qlen >= listen_sock->backlog) {
+        return 0;
+    }
+    
+    tcp_child_unlink(sock);
+    sock->accept_queued = 1;
+    if (listen_sock->accept_tail) {
+        listen_sock->accept_tail->queue_next = sock;
+    } else {
+        listen_sock->accept_head = sock;
+    }
+    listen_sock->accept_tail = sock;
+    listen_sock->accept_qlen++;
+    
+    return 1;
+}
+
+// Start the keepalive idle period over, as if the peer had just been heard from
+static void tcp_keepalive_reset(tcp_socket_t *sock) {
+    sock->rcv_tstamp = tcp_now_ms();
+    sock->keep_probes = 0;
+    if (sock->keepalive) {
+        tcp_set_timer(sock, TCP_TIMER_KEEPALIVE, sock->keep_idle * 1000);
+    } else {
+        tcp_clear_timer(sock, TCP_TIMER_KEEPALIVE);
+    }
+}
+
+// Both FINs are acknowledged: hold the 4-tuple for 2MSL so a retransmitted
+// FIN still gets its ACK and stray segments die out (RFC 9293 3.6.1)
+static void tcp_enter_time_wait(tcp_socket_t *sock) {
+    sock->state = TCP_TIME_WAIT;
+    tcp_clear_timer(sock, TCP_TIMER_DELACK);
+    tcp_clear_timer(sock, TCP_TIMER_PERSIST);
+    tcp_clear_timer(sock, TCP_TIMER_KEEPALIVE);
+    tcp_set_timer(sock, TCP_TIMER_TIMEWAIT, 2 * TCP_MSL);
+}
+
+// A reset counts only if it acknowledges our SYN in SYN_SENT, or lies in
+// the receive window otherwise, so a blind one has to guess the sequence
+// number (RFC 9293 3.10.7). TIME_WAIT ignores resets (RFC 1337).
+static int tcp_rst_acceptable(const tcp_socket_t *sock, const struct tcp_rx_seg *rx) {
+    uint32_t seq = ntohl(rx->hdr.seq_num);
+    uint32_t wnd = tcp_rcv_window(sock);
+    
+    switch (sock->state) {
+    case TCP_CLOSED:
+    case TCP_TIME_WAIT:
+        return 0;
+    case TCP_SYN_SENT:
+        return (rx->hdr.flags & TCP_ACK) && ntohl(rx->hdr.ack_num) == sock->snd_nxt;
+    default:
+        if (wnd == 0) {
+            return seq == sock->recv_seq;
+        }
+        return SEQ_GEQ(seq, sock->recv_seq) && SEQ_LT(seq, sock->recv_seq + wnd);
+    }
+}
+
+// The peer aborted the connection: fail what the application waits for
+// with ECONNREFUSED for a refused connect, ECONNRESET otherwise, and drop
+// everything outstanding. tcp_stack_input() frees it if nobody holds it.
+static void tcp_reset(tcp_socket_t *sock) {
+    if (sock->state == TCP_SYN_SENT) {
+        printf("Connection refused\n");
+        sock->so_error = ECONNREFUSED;
+    } else {
+        printf("Connection reset by peer\n");
+        sock->so_error = ECONNRESET;
+    }
+    sock->state = TCP_CLOSED;
+    tcp_free_rtx_queue(sock);
+    for (int i = 0; i < TCP_TIMER_COUNT; i++) {
+        tcp_clear_timer(sock, i);
+    }
+}
+
+// Process an incoming segment on a synchronized connection: acknowledgment,
+// payload and FIN. Returns 1 if the segment opened the send window.
+static int tcp_input(tcp_socket_t *sock, const struct tcp_rx_seg *rx) {
+    const struct tcp_header *tcph = &rx->hdr;
+    const uint8_t *data = rx->data;
+    size_t data_len = rx->data_len;
+    
+    if (tcph->flags & TCP_RST) {
+        if (tcp_rst_acceptable(sock, rx)) {
+            tcp_reset(sock);
+        }
+        return 0;
+    }
+    
+    // Any segment shows the peer is alive. It answers the zero-window
+    // probes too, except on an orphan: nobody waits for its data, so it
+    // gives up after TCP_MAX_RETRIES probes whatever the answers.
+    if (sock->keepalive) {
+        sock->rcv_tstamp = tcp_now_ms();
+        sock->keep_probes = 0;
+    }
+    if (sock->sockfd >= 0) {
+        sock->persist_probes = 0;
+    }
+    
+    if (sock->state == TCP_SYN_SENT) {
+        // Only a SYN-ACK for our SYN completes the active open
+        if ((tcph->flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK) &&
+            ntohl(tcph->ack_num) == sock->snd_nxt) {
+            printf("Received SYN-ACK\n");
+            tcp_negotiate_options(sock, &rx->opts);
+            sock->recv_seq = ntohl(tcph->seq_num) + 1;
+            tcp_process_ack(sock, rx);
+            
+            printf("Sending ACK...\n");
+            send_tcp_packet(sock, TCP_ACK, NULL);
+            sock->state = TCP_ESTABLISHED;
+            tcp_keepalive_reset(sock);
+        }
+        return 0;
+    }
+    
+    if (tcph->flags & TCP_SYN) {
+        // Retransmitted SYN or SYN-ACK: our reply was lost, answer it again
+        if (sock->state == TCP_SYN_RCVD && sock->rtx_head) {
+            tcp_retransmit(sock, sock->rtx_head);
+        } else {
+            send_tcp_packet(sock, TCP_ACK, NULL);
+        }
+        return 0;
+    }
+    
+    uint32_t seq = ntohl(tcph->seq_num);
+    
+    // Remember the timestamp to echo; only segments up to the left window
+    // edge count, so old or reordered ones cannot move it (RFC 7323 4.3)
+    if (sock->ts_ok && rx->opts.ts_present && SEQ_LEQ(seq, sock->recv_seq) &&
+        SEQ_GEQ(rx->opts.ts_val, sock->ts_recent)) {
+        sock->ts_recent = rx->opts.ts_val;
+    }
+    
+    int opened = tcp_process_ack(sock, rx);
+    if (opened) {
+        tcp_output(sock);
+    }
+    
+    // Our SYN or FIN being acknowledged advances the state
+    if (sock->snd_una == sock->snd_nxt && !sock->fin_queued) {
+        switch (sock->state) {
+        case TCP_SYN_RCVD:
+            if (sock->parent && !tcp_child_established(sock)) {
+                break;
+            }
+            sock->state = TCP_ESTABLISHED;
+            tcp_keepalive_reset(sock);
+            break;
+        case TCP_FIN_WAIT_1:
+            printf("Received ACK\n");
+            sock->state = TCP_FIN_WAIT_2;
+            if (sock->sockfd < 0) {
+                // Closed already: do not wait forever for the peer's FIN
+                tcp_set_timer(sock, TCP_TIMER_TIMEWAIT, TCP_FIN_TIMEOUT);
+            }
+            break;
+        case TCP_CLOSING:
+            tcp_enter_time_wait(sock);
+            break;
+        case TCP_LAST_ACK:
+            sock->state = TCP_CLOSED;
+            break;
+        }
+    }
+    
+    int need_ack = 0;
+    
+    if (data_len > 0) {
+        if ((sock->state == TCP_ESTABLISHED || sock->state == TCP_FIN_WAIT_1 ||
+             sock->state == TCP_FIN_WAIT_2) &&
+            tcp_queue_data(sock, seq, data, data_len)) {
+            tcp_ack_later(sock, data_len);
+        } else {
+            need_ack = 1;
+        }
+    }
+    
+    if (tcph->flags & TCP_FIN) {
+        if (!sock->fin_received && seq + data_len == sock->recv_seq) {
+            printf("Received FIN\n");
+            sock->recv_seq++;
+            sock->fin_received = 1;
+            
+            switch (sock->state) {
+            case TCP_ESTABLISHED:
+                sock->state = TCP_CLOSE_WAIT;
+                break;
+            case TCP_FIN_WAIT_1:
+                sock->state = TCP_CLOSING;
+                break;
+            case TCP_FIN_WAIT_2:
+                tcp_enter_time_wait(sock);
+                break;
+            }
+        } else if (sock->state == TCP_TIME_WAIT) {
+            // Our last ACK was lost: the peer resent its FIN
+            tcp_set_timer(sock, TCP_TIMER_TIMEWAIT, 2 * TCP_MSL);
+        }
+        need_ack = 1;
+    }
+    
+    // Zero-window and keepalive probes sit just below the window and ask
+    // for an ACK with the current window
+    if (data_len == 0 && !(tcph->flags & TCP_FIN) && seq == sock->recv_seq - 1) {
+        need_ack = 1;
+    }
+    
+    if (need_ack) {
+        send_tcp_packet(sock, TCP_ACK, NULL);
+    }
+    
+    return opened;
+}
+
+// Queue a socket whose state may have changed on its tcp_epoll instance
+static void tcp_wakeup(tcp_socket_t *sock) {
+    if (sock->epfd < 0 || sock->ep_queued) {
+        return;
+    }
+    
+    tcp_epoll_t *ep = &sock->stack->epoll_table[TCP_FD_INDEX(sock->epfd)];
+    sock->ep_next = NULL;
+    if (ep->ready_tail) {
+        ep->ready_tail->ep_next = sock;
+    } else {
+        ep->ready_head = sock;
+    }
+    ep->ready_tail = sock;
+    sock->ep_queued = 1;
+}
+
+// Stop watching a socket, taking it off the ready list
+static void tcp_ep_detach(tcp_socket_t *sock) {
+    if (sock->epfd < 0) {
+        return;
+    }
+    
+    if (sock->ep_queued) {
+        tcp_epoll_t *ep = &sock->stack->epoll_table[TCP_FD_INDEX(sock->epfd)];
+        tcp_socket_t *prev = NULL;
+        for (tcp_socket_t *s = ep->ready_head; s; prev = s, s = s->ep_next) {
+            if (s == sock) {
+                if (prev) {
+                    prev->ep_next = s->ep_next;
+                } else {
+                    ep->ready_head = s->ep_next;
+                }
+                if (ep->ready_tail == s) {
+                    ep->ready_tail = prev;
+                }
+                break;
+            }
+        }
+        sock->ep_queued = 0;
+    }
+    sock->epfd = -1;
+}
+
+// Release a control block and its slot
+static void tcp_free_socket(tcp_socket_t *sock) {
+    if (sock->parent) {
+        tcp_child_unlink(sock);
+    }
+    tcp_ep_detach(sock);
+    tcp_free_rtx_queue(sock);
+    for (int i = 0; i < TCP_TIMER_COUNT; i++) {
+        tcp_clear_timer(sock, i);
+    }
+    tcp_hash_remove(sock);
+    free(sock->send_buffer);
+    free(sock->recv_buffer);
+    tcp_fd_release(sock);
+    tcp_sock_release(sock);
+}
+
+// Process a segment for a listening socket. A SYN starts a new connection
+// in SYN-RCVD that tcp_accept() hands out once the handshake completes;
+// retransmitted SYNs reach that connection through its own 4-tuple.
+static void tcp_listen_input(tcp_socket_t *listen_sock, const struct tcp_rx_seg *rx) {
+    if ((rx->hdr.flags & (TCP_SYN | TCP_ACK | TCP_RST)) != TCP_SYN) {
+        return;
+    }
+    
+    // Both queues are bounded by the backlog; the peer retries a dropped SYN
+    if (listen_sock->syn_qlen >= listen_sock->backlog ||
+        listen_sock->accept_qlen >= listen_sock->backlog) {
+        TCP_MIB_INC(listen_sock->stack, listen_drops);
+        return;
+    }
+    
+    struct sockaddr_in peer_addr;
+    memset(&peer_addr, 0, sizeof(peer_addr));
+    peer_addr.sin_family = AF_INET;
+    peer_addr.sin_addr.s_addr = rx->src_addr;
+    peer_addr.sin_port = rx->hdr.src_port;
+    
+    // Create new socket for this connection
+    int new_sockfd = tcp_stack_socket(listen_sock->stack);
+    if (new_sockfd < 0) {
+        return;
+    }
+    
+    tcp_socket_t *new_sock = tcp_get_socket(new_sockfd);
+    new_sock->parent = listen_sock;
+    new_sock->sndbuf_size = listen_sock->sndbuf_size;
+    new_sock->rcvbuf_size = listen_sock->rcvbuf_size;
+    new_sock->rcv_wscale = tcp_wscale_for(new_sock->rcvbuf_size);
+    new_sock->queue_next = listen_sock->syn_head;
+    listen_sock->syn_head = new_sock;
+    listen_sock->syn_qlen++;
+    new_sock->cc = listen_sock->cc;
+    new_sock->cc->init(new_sock);
+    new_sock->keepalive = listen_sock->keepalive;
+    new_sock->keep_idle = listen_sock->keep_idle;
+    new_sock->keep_intvl = listen_sock->keep_intvl;
+    new_sock->keep_cnt = listen_sock->keep_cnt;
+    new_sock->nodelay = listen_sock->nodelay;
+    new_sock->cork = listen_sock->cork;
+    
+    // Copy addresses; the connection is bound to the address the SYN was sent to
+    memcpy(&new_sock->local_addr, &listen_sock->local_addr, sizeof(struct sockaddr_in));
+    new_sock->local_addr.sin_addr.s_addr = rx->dst_addr;
+    memcpy(&new_sock->remote_addr, &peer_addr, sizeof(struct sockaddr_in));
+    tcp_route_lookup(new_sock);
+    tcp_negotiate_options(new_sock, &rx->opts);
+    
+    // Update sequence numbers (the window in a SYN is never scaled)
+    new_sock->recv_seq = ntohl(rx->hdr.seq_num) + 1;
+    new_sock->snd_wnd = ntohs(rx->hdr.window);
+    new_sock->snd_wl1 = ntohl(rx->hdr.seq_num);
+    new_sock->snd_wl2 = new_sock->snd_una;
+    
+    // Send SYN-ACK; it is retransmitted if it gets lost
+    new_sock->state = TCP_SYN_RCVD;
+    tcp_hash_insert(new_sock);
+    TCP_MIB_INC(new_sock->stack, passive_opens);
+    if (tcp_output_segment(new_sock, TCP_SYN | TCP_ACK) < 0) {
+        tcp_free_socket(new_sock);
+    }
+}
+
+// Connection dropped by a timer: report it to the application, or free it
+// if it never reached one or was already closed
+static void tcp_timeout_drop(tcp_socket_t *sock) {
+    TCP_MIB_INC(sock->stack, conn_drops);
+    tcp_wakeup(sock);
+    if (sock->parent || sock->sockfd < 0) {
+        tcp_free_socket(sock);  // Nobody holds it
+    }
+}
+
+// Persist timer: send a zero-window probe and back off like the RTO. The
+// peer's window may stay closed for as long as it keeps answering; after
+// TCP_MAX_RETRIES probes without an answer the connection is dropped.
+// Returns -1 once it has been.
+static int tcp_persist_expired(tcp_socket_t *sock) {
+    if (sock->persist_probes >= TCP_MAX_RETRIES) {
+        printf("Zero-window probes unanswered, dropping connection\n");
+        tcp_free_rtx_queue(sock);
+        sock->state = TCP_CLOSED;
+        sock->so_error = ETIMEDOUT;
+        return -1;
+    }
+    
+    send_tcp_segment(sock, sock->snd_una - 1, TCP_ACK, NULL);
+    sock->persist_probes++;
+    sock->persist_ms = sock->persist_ms * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : sock->persist_ms * 2;
+    tcp_set_timer(sock, TCP_TIMER_PERSIST, sock->persist_ms);
+    return 0;
+}
+
+// Keepalive timer: once the peer has been silent for keep_idle seconds,
+// probe it every keep_intvl seconds and drop the connection after keep_cnt
+// probes go unanswered. Outstanding data is watched by the RTO instead.
+static void tcp_keepalive_expired(tcp_socket_t *sock) {
+    if (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT &&
+        sock->state != TCP_FIN_WAIT_2) {
+        return;
+    }
+    
+    uint32_t idle_ms = sock->keep_idle * 1000;
+    uint64_t silent = tcp_now_ms() - sock->rcv_tstamp;
+    
+    if (sock->rtx_head || sock->snd_len > 0) {
+        sock->keep_probes = 0;
+        tcp_set_timer(sock, TCP_TIMER_KEEPALIVE, idle_ms);
+        return;
+    }
+    if (silent < idle_ms) {
+        tcp_set_timer(sock, TCP_TIMER_KEEPALIVE, idle_ms - silent);
+        return;
+    }
+    if (sock->keep_probes >= sock->keep_cnt) {
+        printf("Keepalive probes unanswered, dropping connection\n");
+        sock->state = TCP_CLOSED;
+        sock->so_error = ETIMEDOUT;
+        tcp_timeout_drop(sock);
+        return;
+    }
+    
+    send_tcp_segment(sock, sock->snd_una - 1, TCP_ACK, NULL);
+    sock->keep_probes++;
+    tcp_set_timer(sock, TCP_TIMER_KEEPALIVE, sock->keep_intvl * 1000);
+}
+
+// 2MSL timer: TIME_WAIT is over, or a closed connection gave up waiting in
+// FIN_WAIT_2. A connection the application has closed goes away; otherwise
+// it is just closed.
+static void tcp_timewait_expired(tcp_socket_t *sock) {
+    if (sock->sockfd < 0) {
+        tcp_free_socket(sock);
+        return;
+    }
+    sock->state = TCP_CLOSED;
+    tcp_hash_remove(sock);
+    tcp_wakeup(sock);
+}
+
+// One of a connection's timers fired
+static void tcp_timer_expired(tcp_timer_t *timer) {
+    tcp_socket_t *sock = (tcp_socket_t *)((char *)(timer - timer->kind) -
+                                          offsetof(tcp_socket_t, timers));
+    
+    switch (timer->kind) {
+    case TCP_TIMER_RTO:
+        if (tcp_rto_expired(sock) < 0) {
+            tcp_timeout_drop(sock);
+        }
+        break;
+    case TCP_TIMER_DELACK:
+        send_tcp_packet(sock, TCP_ACK, NULL);
+        break;
+    case TCP_TIMER_PERSIST:
+        if (tcp_persist_expired(sock) < 0) {
+            tcp_timeout_drop(sock);
+        }
+        break;
+    case TCP_TIMER_KEEPALIVE:
+        tcp_keepalive_expired(sock);
+        break;
+    case TCP_TIMER_TIMEWAIT:
+        tcp_timewait_expired(sock);
+        break;
+    }
+}
+
+// Fire the stack's due timers. Returns the tick of the next one (ms, 0 =
+// none); only connections with a timer due are touched.
+static uint64_t tcp_run_timers(tcp_stack_t *stack) {
+    tcp_timer_run(&stack->timers, tcp_now_ms(), tcp_timer_expired);
+    return tcp_timer_next(&stack->timers);
+}
+
+// Hand one received IPv4 packet to the control block it belongs to; the
+// backends call this for every packet they take in, with the TCP_RX_*
+// flags for what they know of its checksum.
+// Returns 1 if it was delivered, 0 if it is not for us.
+int tcp_stack_input_flags(tcp_stack_t *stack, const uint8_t *pkt, int len, int flags) {
+    struct tcp_rx_seg seg;
+    tcp_socket_t *sock;
+    
+    TCP_MIB_INC(stack, in_packets);
+    tcp_rx_parse(stack, pkt, len, flags, &seg, &sock);
+    if (!sock) {
+        return 0;
+    }
+    TCP_MIB_INC(stack, in_segs);
+    
+    // A new SYN above the old sequence space, or with a newer timestamp,
+    // ends TIME_WAIT early and goes to the listener (RFC 1122 4.2.2.13,
+    // RFC 6191)
+    if (sock->state == TCP_TIME_WAIT &&
+        (seg.hdr.flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN &&
+        (SEQ_GT(ntohl(seg.hdr.seq_num), sock->recv_seq) ||
+         (sock->ts_ok && seg.opts.ts_present && SEQ_GT(seg.opts.ts_val, sock->ts_recent)))) {
+        tcp_timewait_expired(sock);
+        sock = tcp_lookup(stack, seg.src_addr, seg.hdr.src_port, seg.dst_addr, seg.hdr.dst_port);
+        if (!sock) {
+            return 1;
+        }
+    }
+    
+    if (sock->listening) {
+        tcp_listen_input(sock, &seg);
+    } else {
+        sock->segs_in++;
+        tcp_input(sock, &seg);
+        if (sock->state == TCP_CLOSED && (sock->sockfd < 0 || sock->parent)) {
+            // Shutdown of a closed connection is complete, or a connection
+            // not accepted yet was reset
+            tcp_free_socket(sock);
+            return 1;
+        }
+        tcp_wakeup(sock);
+        if (sock->parent && sock->accept_queued) {
+            tcp_wakeup(sock->parent);  // Ready to be accepted
+        }
+    }
+    return 1;
+}
+
+// Hand over a packet whose checksum must verify in full
+int tcp_stack_input(tcp_stack_t *stack, const uint8_t *pkt, int len) {
+    return tcp_stack_input_flags(stack, pkt, len, 0);
+}
+
+// Drive a stack: run due timers, then wait up to timeout_ms (-1 = forever,
+// cut short by the next timer) for packets from its backend and hand each
+// to the control block it belongs to.
+// Returns the number of segments delivered, -1 on error.
+int tcp_stack_poll(tcp_stack_t *stack, int timeout_ms) {
+    uint64_t next = tcp_run_timers(stack);
+    
+    int wait_ms = timeout_ms;
+    if (next) {
+        uint64_t now = tcp_now_ms();
+        int timer_ms = next > now ? (int)(next - now) : 0;
+        if (wait_ms < 0 || timer_ms < wait_ms) {
+            wait_ms = timer_ms;
+        }
+    }
+    
+    // Whatever the timers and the caller queued goes out before we sleep
+    tcp_tx_flush(stack);
+    
+    int ready = stack->backend->wait(stack, wait_ms);
+    if (ready < 0) {
+        return -1;
+    }
+    if (ready == 0) {
+        tcp_run_timers(stack);
+        tcp_tx_flush(stack);
+        return 0;
+    }
+    
+    // Deliver the whole batch; the ACKs and data it triggers are queued
+    // and leave together in one flush
+    int delivered = stack->backend->rx(stack);
+    tcp_tx_flush(stack);
+    
+    return delivered;
+}
+
+// Conditions a blocked call waits for
+static int tcp_writable(const tcp_socket_t *sock) {
+    return sock->snd_len < sock->sndbuf_size;
+}
+
+static int tcp_all_acked(const tcp_socket_t *sock) {
+    return sock->snd_len == 0 && sock->snd_una == sock->snd_nxt;
+}
+
+// Bytes lent by tcp_recv_zc() no longer count as readable
+static int tcp_readable(const tcp_socket_t *sock) {
+    return sock->recv_len > sock->recv_lent || sock->fin_received;
+}
+
+static int tcp_handshake_done(const tcp_socket_t *sock) {
+    return sock->state != TCP_SYN_SENT;
+}
+
+// Next connection of a listener whose handshake has completed, or NULL
+static tcp_socket_t *tcp_accept_next(const tcp_socket_t *listen_sock) {
+    return listen_sock->accept_head;
+}
+
+// Events a socket is ready for right now
+static uint32_t tcp_poll_mask(const tcp_socket_t *sock) {
+    if (sock->listening) {
+        return tcp_accept_next(sock) ? TCP_EPOLLIN : 0;
+    }
+    
+    uint32_t mask = 0;
+    if (sock->so_error) {
+        mask |= TCP_EPOLLERR;
+    }
+    if (tcp_readable(sock)) {
+        mask |= TCP_EPOLLIN;
+    }
+    if ((sock->state == TCP_ESTABLISHED || sock->state == TCP_CLOSE_WAIT) && tcp_writable(sock)) {
+        mask |= TCP_EPOLLOUT;
+    }
+    if (sock->state == TCP_CLOSED || sock->state == TCP_TIME_WAIT) {
+        mask |= TCP_EPOLLHUP;
+    }
+    return mask;
+}
+
+// Drive the stack until cond holds for sock. Returns 0 once it does, -2
+// after timeout_ms (-1 = forever), -1 with errno set if the connection was
+// dropped.
+static int tcp_wait(tcp_socket_t *sock, int (*cond)(const tcp_socket_t *), int timeout_ms) {
+    uint64_t deadline = timeout_ms >= 0 ? tcp_now_ms() + timeout_ms : UINT64_MAX;
+    
+    while (!cond(sock)) {
+        if (sock->so_error) {
+            errno = sock->so_error;
+            return -1;
+        }
+        
+        uint64_t now = tcp_now_ms();
+        if (now >= deadline) {
+            return -2;
+        }
+        if (tcp_stack_poll(sock->stack, deadline == UINT64_MAX ? -1 : (int)(deadline - now)) < 0) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Drive the stack for up to timeout_ms while the connection stays in state
+static void tcp_wait_state_change(tcp_socket_t *sock, int state, int timeout_ms) {
+    uint64_t deadline = tcp_now_ms() + timeout_ms;
+    
+    while (sock->state == state && !sock->so_error) {
+        uint64_t now = tcp_now_ms();
+        if (now >= deadline || tcp_stack_poll(sock->stack, (int)(deadline - now)) < 0) {
+            return;
+        }
+    }
+}
+
+// Set up a stack in slot id of the stack table and open its backend
+static tcp_stack_t *tcp_stack_new(const tcp_stack_config_t *config, int id) {
+    if ((config->mtu != 0 && (config->mtu < 68 || config->mtu > 65535)) ||
+        config->shards < 0 || config->shards > TCP_MAX_STACKS ||
+        config->shard < 0 || (config->shard > 0 && config->shard >= config->shards)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    tcp_stack_t *stack = calloc(1, sizeof(tcp_stack_t));
+    if (stack == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    stack->id = id;
+    stack->backend = config->backend ? config->backend : &tcp_backend_raw;
+    snprintf(stack->ifname, sizeof(stack->ifname), "%s", config->ifname ? config->ifname : "");
+    stack->addr = config->addr;
+    stack->mtu = config->mtu;
+    stack->shard = config->shard;
+    stack->shards = config->shards > 1 ? config->shards : 1;
+    stack->rand_state = (uint32_t)tcp_now_us() ^ ((uint32_t)(id + 1) * 0x9E3779B1u);
+    if (stack->rand_state == 0) {
+        stack->rand_state = 1;
+    }
+    stack->ip_id = tcp_random(stack);
+    stack->wake_fd = -1;
+    stack->timers.now = tcp_now_ms();
+    tcp_pktpool_init(&stack->pktpool);
+    
+    // The backend may learn the MTU from its device
+    if (stack->backend->open(stack) < 0) {
+        tcp_pktpool_destroy(&stack->pktpool);
+        free(stack);
+        return NULL;
+    }
+    if (stack->mtu == 0) {
+        stack->mtu = TCP_MTU_DEFAULT;
+    }
+    
+    __atomic_store_n(&stack_table[id], stack, __ATOMIC_RELEASE);
+    return stack;
+}
+
+// Create a stack instance with its own backend, connections and
+// descriptors (config NULL = raw socket, kernel-chosen addresses)
+tcp_stack_t *tcp_stack_create(const tcp_stack_config_t *config) {
+    static const tcp_stack_config_t defaults;
+    tcp_stack_t *stack = NULL;
+    
+    tcp_init();
+    pthread_mutex_lock(&stack_lock);
+    int id = 1;
+    while (id < TCP_MAX_STACKS && stack_table[id] != NULL) {
+        id++;
+    }
+    if (id < TCP_MAX_STACKS) {
+        stack = tcp_stack_new(config ? config : &defaults, id);
+    } else {
+        errno = EMFILE;
+    }
+    pthread_mutex_unlock(&stack_lock);
+    
+    return stack;
+}
+
+// Create count stacks that share one link, stack i owning the flows that
+// tcp_flow_shard() maps to i, and store them in stacks. Each must be driven
+// by its own thread; an application listens on every one of them.
+// Returns 0, or -1 with errno set and no stack left behind.
+int tcp_shards_create(const tcp_stack_config_t *config, int count, tcp_stack_t **stacks) {
+    if (config == NULL || count < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    tcp_stack_config_t shard_config = *config;
+    shard_config.shards = count;
+    for (int i = 0; i < count; i++) {
+        shard_config.shard = i;
+        stacks[i] = tcp_stack_create(&shard_config);
+        if (stacks[i] == NULL) {
+            int err = errno;
+            while (i-- > 0) {
+                tcp_stack_destroy(stacks[i]);
+            }
+            errno = err;
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// Stack behind tcp_socket() and tcp_epoll_create(), created on first use
+// with the backend chosen by tcp_init_rx(). NULL with errno set if its
+// backend cannot be opened.
+tcp_stack_t *tcp_stack_default(void) {
+    tcp_stack_t *stack = __atomic_load_n(&default_stack, __ATOMIC_ACQUIRE);
+    if (stack != NULL) {
+        return stack;
+    }
+    
+    tcp_init();
+    pthread_mutex_lock(&stack_lock);
+    if (default_stack == NULL) {
+        tcp_stack_config_t config = { .backend = default_backend, .ifname = default_ifname };
+        __atomic_store_n(&default_stack, tcp_stack_new(&config, 0), __ATOMIC_RELEASE);
+    }
+    stack = default_stack;
+    pthread_mutex_unlock(&stack_lock);
+    
+    return stack;
+}
+
+// Drop every connection of a stack without notifying the peers, close
+// its backend and release it. Its rings must be destroyed first.
+void tcp_stack_destroy(tcp_stack_t *stack) {
+    tcp_tx_flush(stack);
+    
+    for (int i = 0; i < stack->fd_table_size; i++) {
+        tcp_socket_t *sock = stack->fd_table[i];
+        if (sock) {
+            tcp_free_rtx_queue(sock);
+            free(sock->send_buffer);
+            free(sock->recv_buffer);
+        }
+    }
+    
+    // Closed connections still shutting down no longer have a descriptor
+    for (int i = 0; i < TCP_HASH_SIZE; i++) {
+        for (tcp_socket_t *sock = stack->conn_hash[i]; sock; sock = sock->hash_next) {
+            if (sock->sockfd < 0) {
+                tcp_free_rtx_queue(sock);
+                free(sock->send_buffer);
+                free(sock->recv_buffer);
+            }
+        }
+    }
+    while (stack->slab_list) {
+        tcp_slab_t *slab = stack->slab_list;
+        stack->slab_list = slab->next;
+        free(slab);
+    }
+    free(stack->fd_table);
+    free(stack->fd_free);
+    
+    stack->backend->close(stack);
+    tcp_pktpool_destroy(&stack->pktpool);
+    if (stack->wake_fd >= 0) {
+        close(stack->wake_fd);
+    }
+    pthread_mutex_lock(&stack_lock);
+    __atomic_store_n(&stack_table[stack->id], NULL, __ATOMIC_RELEASE);
+    if (stack == default_stack) {
+        __atomic_store_n(&default_stack, NULL, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&stack_lock);
+    free(stack);
+}
+
+// Create a TCP socket on a given stack
+int tcp_stack_socket(tcp_stack_t *stack) {
+    // Initialize socket control block
+    tcp_socket_t *sock = tcp_sock_alloc(stack);
+    if (sock == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int fd = tcp_fd_alloc(sock);
+    if (fd < 0) {
+        tcp_sock_release(sock);
+        return -1;
+    }
+    
+    for (int i = 0; i < TCP_TIMER_COUNT; i++) {
+        sock->timers[i].kind = i;
+    }
+    sock->keep_idle = TCP_KEEPIDLE_DEFAULT;
+    sock->keep_intvl = TCP_KEEPINTVL_DEFAULT;
+    sock->keep_cnt = TCP_KEEPCNT_DEFAULT;
+    sock->epfd = -1;
+    sock->state = TCP_CLOSED;
+    sock->snd_nxt = tcp_random(stack) % 1000000;  // Random initial sequence number
+    sock->snd_una = sock->snd_nxt;
+    sock->snd_wnd = 0;
+    sock->rto_ms = TCP_RTO_INITIAL;
+    sock->recover = sock->snd_nxt;
+    sock->snd_sml = sock->snd_nxt;
+    sock->mss = TCP_MSS;
+    sock->adv_mss = TCP_MSS;
+    sock->cwnd = tcp_initial_cwnd(sock->mss);
+    sock->sndbuf_size = TCP_BUFFER_SIZE;
+    sock->rcvbuf_size = TCP_BUFFER_SIZE;
+    sock->rcv_wscale = tcp_wscale_for(sock->rcvbuf_size);
+    sock->ssthresh = UINT32_MAX;
+    sock->cc = tcp_cc_find(TCP_CC_DEFAULT);
+    sock->cc->init(sock);
+    sock->recv_seq = 0;
+    sock->recv_len = 0;
+    sock->listening = 0;
+    
+    return fd;
+}
+
+// Create a TCP socket on the default stack
+int tcp_socket(void) {
+    tcp_stack_t *stack = tcp_stack_default();
+    if (stack == NULL) {
+        return -1;
+    }
+    return tcp_stack_socket(stack);
+}
+
+// Bind socket to address
+int tcp_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    (void)addrlen; // Unused parameter
+    
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    memcpy(&sock->local_addr, addr, sizeof(struct sockaddr_in));
+    
+    return 0;
+}
+
+// Listen for connections
+int tcp_listen(int sockfd, int backlog) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    
+    if (backlog <= 0) {
+        backlog = MAX_PENDING_CONN;
+    }
+    
+    sock->state = TCP_LISTEN;
+    sock->listening = 1;
+    sock->backlog = backlog;
+    tcp_hash_insert(sock);
+    
+    printf("Socket %d listening on port %d\n", sockfd, ntohs(sock->local_addr.sin_port));
+    
+    return 0;
+}
+
+// Accept incoming connection
+int tcp_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    tcp_socket_t *listen_sock = tcp_get_socket(sockfd);
+    if (listen_sock == NULL) {
+        return -1;
+    }
+    
+    if (listen_sock->state != TCP_LISTEN) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // Handshakes advance in the background; wait for one to complete
+    tcp_socket_t *new_sock;
+    if (listen_sock->nonblock) {
+        if ((new_sock = tcp_accept_next(listen_sock)) == NULL) {
+            tcp_stack_poll(listen_sock->stack, 0);
+            new_sock = tcp_accept_next(listen_sock);
+        }
+        if (new_sock == NULL) {
+            errno = EAGAIN;
+            return -1;
+        }
+    } else {
+        printf("Waiting for incoming connection...\n");
+        while ((new_sock = tcp_accept_next(listen_sock)) == NULL) {
+            if (tcp_stack_poll(listen_sock->stack, -1) < 0) {
+                return -1;
+            }
+        }
+    }
+    
+    printf("Received ACK, connection established\n");
+    tcp_child_unlink(new_sock);
+    new_sock->parent = NULL;
+    
+    if (addr && addrlen) {
+        memcpy(addr, &new_sock->remote_addr, sizeof(struct sockaddr_in));
+        *addrlen = sizeof(struct sockaddr_in);
+    }
+    
+    return new_sock->sockfd;
+}
+
+// Connect to remote host
+int tcp_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    (void)addrlen; // Unused parameter
+    
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    memcpy(&sock->remote_addr, addr, sizeof(struct sockaddr_in));
+    
+    printf("Connecting to %s:%d...\n", 
+           inet_ntoa(sock->remote_addr.sin_addr),
+           ntohs(sock->remote_addr.sin_port));
+    
+    tcp_route_lookup(sock);
+    if (sock->local_addr.sin_port == 0 && tcp_pick_port(sock) < 0) {
+        return -1;
+    }
+    if (!tcp_flow_ours(sock, sock->local_addr.sin_port)) {
+        errno = EADDRNOTAVAIL;  // Bound to a port whose replies go to another shard
+        return -1;
+    }
+    tcp_hash_insert(sock);
+    
+    // Send SYN
+    sock->state = TCP_SYN_SENT;
+    TCP_MIB_INC(sock->stack, active_opens);
+    printf("Sending SYN...\n");
+    if (tcp_output_segment(sock, TCP_SYN) < 0) {
+        tcp_hash_remove(sock);
+        sock->state = TCP_CLOSED;
+        return -1;
+    }
+    
+    // A non-blocking connect completes in the background; TCP_EPOLLOUT
+    // reports when it is established
+    if (sock->nonblock) {
+        tcp_tx_flush(sock->stack);
+        errno = EINPROGRESS;
+        return -1;
+    }
+    
+    // Wait for SYN-ACK (the SYN is retransmitted if it gets lost)
+    printf("Waiting for SYN-ACK...\n");
+    int ret = tcp_wait(sock, tcp_handshake_done, 5000);
+    
+    if (ret == 0 && sock->state == TCP_ESTABLISHED) {
+        printf("Connection established\n");
+        return 0;
+    }
+    
+    if (ret == -2) {
+        printf("SYN-ACK timeout\n");
+        errno = ETIMEDOUT;
+    } else if (ret == 0) {
+        errno = sock->so_error;  // Refused by the peer
+    }
+    tcp_free_rtx_queue(sock);
+    tcp_hash_remove(sock);
+    sock->state = TCP_CLOSED;
+    return -1;
+}
+
+// Queue iovcnt buffers on sock for tcp_sendv(). With poll = 0 the stack is
+// never polled: the call is non-blocking and what it queues leaves with
+// the caller's next tcp_stack_poll().
+static ssize_t tcp_send_iov(tcp_socket_t *sock, const struct iovec *iov, int iovcnt,
+                            int flags, int poll) {
+    if (sock->so_error) {
+        errno = sock->so_error;
+        return -1;
+    }
+    if (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    
+    int nonblock = sock->nonblock || (flags & MSG_DONTWAIT);
+    
+    if (sock->send_buffer == NULL && (sock->send_buffer = malloc(sock->sndbuf_size)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    
+    // Copy into the send ring and push out as much as the congestion and
+    // peer's windows allow; the rest goes out as ACKs slide the window.
+    // The stack is only polled once the ring is full.
+    size_t sent = 0;
+    int cur = 0;                      // Buffer being copied and the offset in it
+    size_t off = 0;
+    while (sent < len) {
+        uint32_t space = sock->sndbuf_size - sock->snd_len;
+        
+        if (space == 0) {
+            // Take in ACKs that drain the ring, blocking for them unless
+            // told not to. Lost segments are retransmitted while we wait.
+            if (!poll) {
+                break;
+            } else if (nonblock) {
+                tcp_stack_poll(sock->stack, 0);
+            } else if (tcp_wait(sock, tcp_writable, -1) < 0) {
+                return sent > 0 ? (ssize_t)sent : -1;
+            }
+            
+            // The poll may have taken in a reset or a timeout
+            if (sock->so_error || (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT)) {
+                if (sent > 0) {
+                    return sent;
+                }
+                errno = sock->so_error ? sock->so_error : EPIPE;
+                return -1;
+            }
+            
+            space = sock->sndbuf_size - sock->snd_len;
+            if (space == 0) {
+                break;
+            }
+        }
+        
+        // Gather as much as fits before cutting segments
+        while (space > 0 && sent < len) {
+            size_t n = iov[cur].iov_len - off < space ? iov[cur].iov_len - off : space;
+            tcp_sbuf_write(sock, (const uint8_t *)iov[cur].iov_base + off, n);
+            sent += n;
+            space -= n;
+            off += n;
+            if (off == iov[cur].iov_len) {
+                cur++;
+                off = 0;
+            }
+        }
+        
+        if (tcp_output(sock) < 0) {
+            tcp_tx_flush(sock->stack);
+            return sent;
+        }
+    }
+    if (poll) {
+        tcp_tx_flush(sock->stack);
+    }
+    
+    if (sent == 0 && len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    return sent;
+}
+
+// Send the concatenation of iovcnt buffers as one stream of data, so a
+// header and a payload kept elsewhere (such as data lent by tcp_recv_zc())
+// share segments without being copied together first
+ssize_t tcp_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    return tcp_send_iov(sock, iov, iovcnt, flags, 1);
+}
+
+// Send data
+ssize_t tcp_send(int sockfd, const void *buf, size_t len, int flags) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return tcp_sendv(sockfd, &iov, 1, flags);
+}
+
+// Send from the thread driving the stack, without polling it
+ssize_t tcp_stack_send(int sockfd, const void *buf, size_t len, int flags) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return tcp_send_iov(sock, &iov, 1, flags, 0);
+}
+
+// Wait until sock has in-order data or EOF, or only take in what has
+// arrived for a non-blocking read; with poll = 0 only look at the receive
+// ring.
+// Returns 0 when there is something to read, -1 with errno set otherwise.
+static int tcp_recv_wait(tcp_socket_t *sock, int flags, int poll) {
+    if (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT &&
+        !tcp_readable(sock)) {
+        errno = sock->so_error ? sock->so_error : ENOTCONN;
+        return -1;
+    }
+    
+    if (sock->nonblock || (flags & MSG_DONTWAIT) || !poll) {
+        // Take in what has already arrived, but never wait for more; the
+        // stack is only polled when nothing is buffered
+        if (poll && !tcp_readable(sock)) {
+            tcp_stack_poll(sock->stack, 0);
+        }
+        if (!tcp_readable(sock)) {
+            errno = sock->so_error ? sock->so_error : EAGAIN;
+            return -1;
+        }
+    } else {
+        // Wait for in-order data or the peer's FIN
+        int ret = tcp_wait(sock, tcp_readable, 10000);
+        if (ret < 0) {
+            if (ret == -2) {
+                errno = EAGAIN;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reading freed room in the receive ring: tell the peer once the window
+// has opened substantially (RFC 1122 SWS avoidance)
+static void tcp_rcv_window_update(tcp_socket_t *sock) {
+    uint32_t threshold = sock->rcvbuf_size / 2 < 2 * sock->mss ? sock->rcvbuf_size / 2 : 2 * sock->mss;
+    if (SEQ_GEQ(sock->recv_seq + tcp_rcv_window(sock), sock->rcv_adv + threshold)) {
+        send_tcp_packet(sock, TCP_ACK, NULL);
+        tcp_tx_flush(sock->stack);
+    }
+}
+
+// Read from sock for tcp_recv(); poll as for tcp_recv_wait()
+static ssize_t tcp_recv_copy(tcp_socket_t *sock, void *buf, size_t len, int flags, int poll) {
+    // The ring is read in order: lent data has to be given back first
+    if (sock->recv_lent > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (tcp_recv_wait(sock, flags, poll) < 0) {
+        return -1;
+    }
+    
+    // Copy buffered data to user buffer; nothing left after a FIN means EOF
+    size_t copy_len = (size_t)sock->recv_len < len ? (size_t)sock->recv_len : len;
+    if (flags & MSG_PEEK) {
+        tcp_rbuf_peek(sock, buf, copy_len);
+    } else if (copy_len > 0) {
+        tcp_rbuf_read(sock, buf, copy_len);
+        tcp_rcv_window_update(sock);
+    }
+    
+    return copy_len;
+}
+
+// Receive data
+ssize_t tcp_recv(int sockfd, void *buf, size_t len, int flags) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    return tcp_recv_copy(sock, buf, len, flags, 1);
+}
+
+// Receive from the thread driving the stack, without polling it
+ssize_t tcp_stack_recv(int sockfd, void *buf, size_t len, int flags) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    return tcp_recv_copy(sock, buf, len, flags, 0);
+}
+
+// Lend the received data not lent yet without copying it: iov[0] and, if
+// the ring wraps, iov[1] point into the receive ring (*iovcnt = 1 or 2).
+// Waits like tcp_recv(). Returns the bytes lent, 0 at EOF. The data stays
+// put and counts against the receive window until tcp_recv_release()
+// gives it back, or until the socket is closed.
+ssize_t tcp_recv_zc(int sockfd, struct iovec *iov, int *iovcnt, int flags) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    if (tcp_recv_wait(sock, flags & ~MSG_PEEK, 1) < 0) {
+        return -1;
+    }
+    
+    uint32_t len = sock->recv_len - sock->recv_lent;
+    uint32_t pos = (sock->recv_head + sock->recv_lent) % sock->rcvbuf_size;
+    uint32_t first = sock->rcvbuf_size - pos;
+    if (first > len) {
+        first = len;
+    }
+    
+    iov[0].iov_base = sock->recv_buffer + pos;
+    iov[0].iov_len = first;
+    *iovcnt = 1;
+    if (len > first) {
+        iov[1].iov_base = sock->recv_buffer;
+        iov[1].iov_len = len - first;
+        *iovcnt = 2;
+    }
+    sock->recv_lent += len;
+    
+    return len;
+}
+
+// Give back the oldest len bytes lent by tcp_recv_zc(), opening the
+// receive window by as much
+int tcp_recv_release(int sockfd, size_t len) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    if (len > (size_t)sock->recv_lent) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (len > 0) {
+        tcp_rbuf_consume(sock, len);
+        sock->recv_lent -= len;
+        tcp_rcv_window_update(sock);
+    }
+    return 0;
+}
+
+// Close connection
+int tcp_close(int sockfd) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    
+    // Let data still in flight be acknowledged before the FIN; closing
+    // pulls the cork. A non-blocking close, or one whose data is still
+    // unacknowledged after TCP_LINGER_TIMEOUT, returns at once instead: the
+    // FIN follows the data still queued, and the stack frees the connection
+    // when the shutdown is over.
+    if (sock->state == TCP_ESTABLISHED || sock->state == TCP_CLOSE_WAIT) {
+        sock->cork = 0;
+        int drained = 0;
+        if (!sock->nonblock) {
+            tcp_output(sock);
+            drained = tcp_wait(sock, tcp_all_acked, TCP_LINGER_TIMEOUT) != -2;
+        }
+        if (!drained) {
+            printf("Closing connection...\n");
+            sock->state = sock->state == TCP_ESTABLISHED ? TCP_FIN_WAIT_1 : TCP_LAST_ACK;
+            sock->fin_queued = 1;
+            tcp_ep_detach(sock);
+            tcp_fd_release(sock);
+            tcp_output(sock);
+            tcp_tx_flush(sock->stack);
+            return 0;
+        }
+    }
+    
+    if (sock->state == TCP_ESTABLISHED) {
+        printf("Closing connection...\n");
+        
+        // Send FIN
+        printf("Sending FIN...\n");
+        tcp_output_segment(sock, TCP_FIN | TCP_ACK);
+        sock->state = TCP_FIN_WAIT_1;
+        
+        // Wait for ACK; the peer may send its own FIN on the same segment
+        printf("Waiting for ACK...\n");
+        tcp_wait_state_change(sock, TCP_FIN_WAIT_1, 2000);
+        tcp_wait_state_change(sock, TCP_CLOSING, 2000);
+        
+        // Wait for FIN
+        if (sock->state == TCP_FIN_WAIT_2) {
+            printf("Waiting for FIN...\n");
+            tcp_wait_state_change(sock, TCP_FIN_WAIT_2, 2000);
+        }
+    } else if (sock->state == TCP_CLOSE_WAIT) {
+        // Send FIN
+        printf("Sending FIN...\n");
+        tcp_output_segment(sock, TCP_FIN | TCP_ACK);
+        sock->state = TCP_LAST_ACK;
+        
+        // Wait for ACK, retransmitting the FIN if needed
+        printf("Waiting for final ACK...\n");
+        tcp_wait_state_change(sock, TCP_LAST_ACK, 2000);
     }
     
-    // Calculate TCP checksum with pseudo header
-    struct pseudo_header psh;
-    psh.src_addr = sock->local_addr.sin_addr.s_addr;
-    psh.dst_addr = sock->remote_addr.sin_addr.s_addr;
-    psh.zero = 0;
-    psh.protocol = IPPROTO_TCP;
-    psh.tcp_length = htons(sizeof(struct tcp_header) + data_len);
-    
-    size_t pseudo_packet_len = sizeof(struct pseudo_header) + sizeof(struct tcp_header) + data_len;
-    char *pseudo_packet = malloc(pseudo_packet_len);
-    memcpy(pseudo_packet, &psh, sizeof(struct pseudo_header));
-    memcpy(pseudo_packet + sizeof(struct pseudo_header), tcph, sizeof(struct tcp_header) + data_len);
+    // TIME_WAIT outlives the descriptor: the connection stays in the
+    // stack without its buffers until the 2MSL timer frees it
+    if (sock->state == TCP_TIME_WAIT) {
+        tcp_ep_detach(sock);
+        free(sock->send_buffer);
+        free(sock->recv_buffer);
+        sock->send_buffer = NULL;
+        sock->recv_buffer = NULL;
+        tcp_fd_release(sock);
+        printf("Connection closed\n");
+        return 0;
+    }
     
-    tcph->checksum = tcp_checksum(pseudo_packet, pseudo_packet_len);
-    free(pseudo_packet);
+    // Connections a listener never handed out go with it
+    while (sock->syn_head) {
+        tcp_free_socket(sock->syn_head);
+    }
+    while (sock->accept_head) {
+        tcp_free_socket(sock->accept_head);
+    }
     
-    // Send packet
-    int ret = sendto(sock->fd, packet, sizeof(struct ip_header) + sizeof(struct tcp_header) + data_len,
-                     0, (struct sockaddr *)&sock->remote_addr, sizeof(sock->remote_addr));
+    // Close socket
+    tcp_free_socket(sock);
     
-    if (ret < 0) {
-        perror("sendto failed");
-        return -1;
-    }
+    printf("Connection closed\n");
     
-    return ret;
+    return 0;
 }
 
-// Receive TCP packet with timeout
-static int recv_tcp_packet(tcp_socket_t *sock, struct tcp_header *tcph, 
-                          uint8_t *data, size_t *data_len, int timeout_sec) {
-    char buffer[65536];
-    struct sockaddr_in src_addr;
-    socklen_t addr_len = sizeof(src_addr);
+
+// SO_SNDBUF / SO_RCVBUF, clamped to [TCP_BUFFER_MIN, TCP_BUFFER_MAX].
+// The receive size fixes the window scale offered in the SYN, so it can
+// only change before connect() or listen(); the send ring can be resized
+// whenever it holds no unsent data.
+static int tcp_set_bufsize(tcp_socket_t *sock, int optname, const void *optval, socklen_t optlen) {
+    if (optval == NULL || optlen < sizeof(int)) {
+        errno = EINVAL;
+        return -1;
+    }
     
-    // Set receive timeout
-    struct timeval tv;
-    tv.tv_sec = timeout_sec;
-    tv.tv_usec = 0;
-    setsockopt(sock->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int val = *(const int *)optval;
+    uint32_t size = val < TCP_BUFFER_MIN ? TCP_BUFFER_MIN :
+                    val > TCP_BUFFER_MAX ? TCP_BUFFER_MAX : (uint32_t)val;
     
-    while (1) {
-        int ret = recvfrom(sock->fd, buffer, sizeof(buffer), 0,
-                          (struct sockaddr *)&src_addr, &addr_len);
-        
-        if (ret < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return -2;  // Timeout
-            }
+    switch (optname) {
+    case SO_SNDBUF:
+        if (sock->snd_len > 0) {
+            errno = EBUSY;
             return -1;
         }
-        
-        struct ip_header *iph = (struct ip_header *)buffer;
-        int ip_header_len = (iph->version_ihl & 0x0F) * 4;
-        
-        if (ret < (int)(ip_header_len + sizeof(struct tcp_header))) {
-            continue;  // Packet too small
-        }
-        
-        struct tcp_header *recv_tcph = (struct tcp_header *)(buffer + ip_header_len);
-        
-        // Check if packet is for this socket
-        if (sock->listening) {
-            // For listening sockets, only check destination port
-            if (recv_tcph->dst_port != sock->local_addr.sin_port) {
-                continue;
-            }
-        } else {
-            // For connected sockets, check both ports and addresses
-            if (recv_tcph->dst_port != sock->local_addr.sin_port ||
-                recv_tcph->src_port != sock->remote_addr.sin_port ||
-                iph->src_addr != sock->remote_addr.sin_addr.s_addr) {
-                continue;
-            }
-        }
-        
-        // Copy TCP header
-        memcpy(tcph, recv_tcph, sizeof(struct tcp_header));
-        
-        // Copy data if any
-        int tcp_header_len = (recv_tcph->data_offset >> 4) * 4;
-        int payload_len = ret - ip_header_len - tcp_header_len;
-        
-        if (payload_len > 0 && data != NULL) {
-            memcpy(data, buffer + ip_header_len + tcp_header_len, payload_len);
-            *data_len = payload_len;
-        } else {
-            *data_len = 0;
-        }
-        
-        // Update remote address for listening sockets on SYN
-        if (sock->listening && (recv_tcph->flags & TCP_SYN)) {
-            sock->remote_addr.sin_addr.s_addr = iph->src_addr;
-            sock->remote_addr.sin_port = recv_tcph->src_port;
+        free(sock->send_buffer);
+        sock->send_buffer = NULL;  // Reallocated by the next tcp_send()
+        sock->snd_head = 0;
+        sock->sndbuf_size = size;
+        return 0;
+    case SO_RCVBUF:
+        if (sock->state != TCP_CLOSED) {
+            errno = EINVAL;
+            return -1;
         }
-        
+        sock->rcvbuf_size = size;
+        sock->rcv_wscale = tcp_wscale_for(size);
         return 0;
+    default:
+        errno = ENOPROTOOPT;
+        return -1;
     }
 }
 
-// Create a TCP socket
-int tcp_socket(void) {
-    tcp_init();
-    
-    int slot = find_free_socket();
-    if (slot < 0) {
-        errno = EMFILE;
+// SO_KEEPALIVE and the TCP_KEEP* parameters. A connected socket starts
+// its idle period over with the new settings.
+static int tcp_set_keepalive(tcp_socket_t *sock, int optname, const void *optval, socklen_t optlen) {
+    if (optval == NULL || optlen < sizeof(int)) {
+        errno = EINVAL;
         return -1;
     }
     
-    // Create raw socket
-    int fd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-    if (fd < 0) {
-        perror("Raw socket creation failed (need root privileges)");
+    int val = *(const int *)optval;
+    if (optname != SO_KEEPALIVE &&
+        (val < 1 || val > (optname == TCP_KEEPCNT ? TCP_KEEPCNT_MAX : TCP_KEEPTIME_MAX))) {
+        errno = EINVAL;
         return -1;
     }
     
-    // Enable IP_HDRINCL so we can build the IP header ourselves
-    int one = 1;
-    if (setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one)) < 0) {
-        perror("setsockopt IP_HDRINCL failed");
-        close(fd);
-        return -1;
+    switch (optname) {
+    case SO_KEEPALIVE:
+        sock->keepalive = val != 0;
+        break;
+    case TCP_KEEPIDLE:
+        sock->keep_idle = val;
+        break;
+    case TCP_KEEPINTVL:
+        sock->keep_intvl = val;
+        break;
+    case TCP_KEEPCNT:
+        sock->keep_cnt = val;
+        break;
     }
     
-    // Initialize socket control block
-    tcp_socket_t *sock = &socket_table[slot];
-    memset(sock, 0, sizeof(tcp_socket_t));
-    sock->fd = fd;
-    sock->is_used = 1;
-    sock->state = TCP_CLOSED;
-    sock->send_seq = rand() % 1000000;  // Random initial sequence number
-    sock->recv_seq = 0;
-    sock->recv_len = 0;
-    sock->listening = 0;
-    
-    return slot;
-}
-
-// Bind socket to address
-int tcp_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    (void)addrlen; // Unused parameter
-    
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
-        return -1;
+    if (sock->state == TCP_ESTABLISHED || sock->state == TCP_CLOSE_WAIT) {
+        tcp_keepalive_reset(sock);
     }
-    
-    tcp_socket_t *sock = &socket_table[sockfd];
-    memcpy(&sock->local_addr, addr, sizeof(struct sockaddr_in));
-    
     return 0;
 }
 
-// Listen for connections
-int tcp_listen(int sockfd, int backlog) {
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
+// TCP_NODELAY and TCP_CORK. Turning Nagle off or pulling the cork sends
+// what they were holding back.
+static int tcp_set_nagle(tcp_socket_t *sock, int optname, const void *optval, socklen_t optlen) {
+    if (optval == NULL || optlen < sizeof(int)) {
+        errno = EINVAL;
         return -1;
     }
     
-    tcp_socket_t *sock = &socket_table[sockfd];
-    sock->state = TCP_LISTEN;
-    sock->listening = 1;
-    sock->backlog = backlog;
-    
-    printf("Socket %d listening on port %d\n", sockfd, ntohs(sock->local_addr.sin_port));
+    int val = *(const int *)optval != 0;
+    if (optname == TCP_NODELAY) {
+        sock->nodelay = val;
+    } else {
+        sock->cork = val;
+    }
     
+    int released = optname == TCP_NODELAY ? val : !val;
+    if (released && sock->send_buffer &&
+        (sock->state == TCP_ESTABLISHED || sock->state == TCP_CLOSE_WAIT)) {
+        tcp_output(sock);
+        tcp_tx_flush(sock->stack);
+    }
     return 0;
 }
 
-// Accept incoming connection
-int tcp_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
+// Set socket option
+int tcp_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
         return -1;
     }
     
-    tcp_socket_t *listen_sock = &socket_table[sockfd];
-    
-    if (listen_sock->state != TCP_LISTEN) {
-        errno = EINVAL;
+    if (level == SOL_SOCKET) {
+        if (optname == SO_KEEPALIVE) {
+            return tcp_set_keepalive(sock, optname, optval, optlen);
+        }
+        return tcp_set_bufsize(sock, optname, optval, optlen);
+    }
+    if (level != IPPROTO_TCP) {
+        errno = ENOPROTOOPT;
         return -1;
     }
     
-    printf("Waiting for incoming connection...\n");
-    
-    // Wait for SYN packet
-    struct tcp_header tcph;
-    uint8_t data[TCP_MSS];
-    size_t data_len;
-    
-    while (1) {
-        if (recv_tcp_packet(listen_sock, &tcph, data, &data_len, 0) < 0) {
-            continue;
+    switch (optname) {
+    case TCP_NODELAY:
+    case TCP_CORK:
+        return tcp_set_nagle(sock, optname, optval, optlen);
+    case TCP_KEEPIDLE:
+    case TCP_KEEPINTVL:
+    case TCP_KEEPCNT:
+        return tcp_set_keepalive(sock, optname, optval, optlen);
+    case TCP_CONGESTION: {
+        char name[TCP_CC_NAME_MAX];
+        if (optval == NULL || optlen == 0) {
+            errno = EINVAL;
+            return -1;
         }
+        size_t n = optlen < sizeof(name) - 1 ? optlen : sizeof(name) - 1;
+        memcpy(name, optval, n);
+        name[n] = '\0';
         
-        if (tcph.flags & TCP_SYN) {
-            printf("Received SYN from %s:%d\n", 
-                   inet_ntoa(listen_sock->remote_addr.sin_addr),
-                   ntohs(listen_sock->remote_addr.sin_port));
-            break;
+        const tcp_cc_ops_t *cc = tcp_cc_find(name);
+        if (cc == NULL) {
+            errno = ENOENT;
+            return -1;
         }
+        if (cc != sock->cc) {
+            sock->cc = cc;
+            sock->cc->init(sock);
+        }
+        return 0;
     }
-    
-    // Create new socket for this connection
-    int new_sockfd = tcp_socket();
-    if (new_sockfd < 0) {
+    default:
+        errno = ENOPROTOOPT;
         return -1;
     }
-    
-    tcp_socket_t *new_sock = &socket_table[new_sockfd];
-    
-    // Copy addresses
-    memcpy(&new_sock->local_addr, &listen_sock->local_addr, sizeof(struct sockaddr_in));
-    memcpy(&new_sock->remote_addr, &listen_sock->remote_addr, sizeof(struct sockaddr_in));
-    
-    // Update sequence numbers
-    new_sock->recv_seq = ntohl(tcph.seq_num) + 1;
-    new_sock->send_seq = rand() % 1000000;
-    
-    // Send SYN-ACK
-    new_sock->state = TCP_SYN_RCVD;
-    printf("Sending SYN-ACK...\n");
-    send_tcp_packet(new_sock, TCP_SYN | TCP_ACK, NULL, 0);
-    new_sock->send_seq++;
-    
-    // Wait for ACK
-    printf("Waiting for ACK...\n");
-    if (recv_tcp_packet(new_sock, &tcph, data, &data_len, 5) < 0) {
-        printf("ACK timeout\n");
-        tcp_close(new_sockfd);
+}
+
+// Store an integer option value
+static int tcp_get_int(void *optval, socklen_t *optlen, int val) {
+    if (*optlen < sizeof(int)) {
+        errno = EINVAL;
         return -1;
     }
-    
-    if (tcph.flags & TCP_ACK) {
-        printf("Received ACK, connection established\n");
-        new_sock->state = TCP_ESTABLISHED;
-        
-        if (addr && addrlen) {
-            memcpy(addr, &new_sock->remote_addr, sizeof(struct sockaddr_in));
-            *addrlen = sizeof(struct sockaddr_in);
-        }
-        
-        return new_sockfd;
-    }
-    
-    tcp_close(new_sockfd);
-    return -1;
+    *(int *)optval = val;
+    *optlen = sizeof(int);
+    return 0;
 }
 
-// Connect to remote host
-int tcp_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
-    (void)addrlen; // Unused parameter
-    
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
+// Get socket option
+int tcp_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
         return -1;
     }
     
-    tcp_socket_t *sock = &socket_table[sockfd];
-    memcpy(&sock->remote_addr, addr, sizeof(struct sockaddr_in));
-    
-    printf("Connecting to %s:%d...\n", 
-           inet_ntoa(sock->remote_addr.sin_addr),
-           ntohs(sock->remote_addr.sin_port));
-    
-    // Send SYN
-    sock->state = TCP_SYN_SENT;
-    printf("Sending SYN...\n");
-    send_tcp_packet(sock, TCP_SYN, NULL, 0);
-    sock->send_seq++;
-    
-    // Wait for SYN-ACK
-    struct tcp_header tcph;
-    uint8_t data[TCP_MSS];
-    size_t data_len;
-    
-    printf("Waiting for SYN-ACK...\n");
-    if (recv_tcp_packet(sock, &tcph, data, &data_len, 5) < 0) {
-        printf("SYN-ACK timeout\n");
-        sock->state = TCP_CLOSED;
+    if ((level != IPPROTO_TCP && level != SOL_SOCKET) || optval == NULL || optlen == NULL) {
+        errno = optval == NULL || optlen == NULL ? EINVAL : ENOPROTOOPT;
         return -1;
     }
     
-    if ((tcph.flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
-        printf("Received SYN-ACK\n");
-        sock->recv_seq = ntohl(tcph.seq_num) + 1;
-        
-        // Send ACK
-        printf("Sending ACK...\n");
-        send_tcp_packet(sock, TCP_ACK, NULL, 0);
-        
-        sock->state = TCP_ESTABLISHED;
-        printf("Connection established\n");
-        return 0;
+    if (level == SOL_SOCKET) {
+        switch (optname) {
+        case SO_SNDBUF:
+            return tcp_get_int(optval, optlen, sock->sndbuf_size);
+        case SO_RCVBUF:
+            return tcp_get_int(optval, optlen, sock->rcvbuf_size);
+        case SO_KEEPALIVE:
+            return tcp_get_int(optval, optlen, sock->keepalive);
+        case SO_ERROR: {
+            // Reading the pending error clears it
+            int err = sock->so_error;
+            sock->so_error = 0;
+            return tcp_get_int(optval, optlen, err);
+        }
+        default:
+            errno = ENOPROTOOPT;
+            return -1;
+        }
     }
     
-    sock->state = TCP_CLOSED;
-    return -1;
+    switch (optname) {
+    case TCP_NODELAY:
+        return tcp_get_int(optval, optlen, sock->nodelay);
+    case TCP_CORK:
+        return tcp_get_int(optval, optlen, sock->cork);
+    case TCP_KEEPIDLE:
+        return tcp_get_int(optval, optlen, sock->keep_idle);
+    case TCP_KEEPINTVL:
+        return tcp_get_int(optval, optlen, sock->keep_intvl);
+    case TCP_KEEPCNT:
+        return tcp_get_int(optval, optlen, sock->keep_cnt);
+    case TCP_CONGESTION: {
+        size_t n = strlen(sock->cc->name) + 1;
+        if (n > *optlen) {
+            n = *optlen;
+        }
+        memcpy(optval, sock->cc->name, n);
+        *optlen = n;
+        return 0;
+    }
+    default:
+        errno = ENOPROTOOPT;
+        return -1;
+    }
 }
 
-// Send data
-ssize_t tcp_send(int sockfd, const void *buf, size_t len, int flags) {
-    (void)flags; // Unused parameter
-    
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
+// Report a connection's state and counters
+int tcp_getinfo(int sockfd, tcp_conn_info_t *info) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    if (info == NULL) {
+        errno = EINVAL;
         return -1;
     }
     
-    tcp_socket_t *sock = &socket_table[sockfd];
+    memset(info, 0, sizeof(*info));
+    info->state = sock->state;
+    info->srtt_us = sock->srtt_us;
+    info->rttvar_us = sock->rttvar_us;
+    info->rto_ms = sock->rto_ms;
+    info->mss = sock->mss;
+    info->cwnd = sock->cwnd;
+    info->ssthresh = sock->ssthresh;
+    info->snd_wnd = sock->snd_wnd;
+    info->unacked = sock->snd_nxt - sock->snd_una;
+    info->snd_queued = sock->snd_len;
+    info->rcv_queued = sock->recv_len;
+    info->in_recovery = sock->in_recovery;
+    info->bytes_sent = sock->bytes_sent;
+    info->bytes_retrans = sock->bytes_retrans;
+    info->bytes_acked = sock->bytes_acked;
+    info->bytes_received = sock->bytes_received;
+    info->segs_out = sock->segs_out;
+    info->segs_in = sock->segs_in;
+    info->retrans_segs = sock->retrans_segs;
+    info->timeouts = sock->timeouts;
+    info->dupacks = sock->dupacks_in;
+    info->ooo_segs = sock->ooo_segs;
+    return 0;
+}
+
+// Add a stack's counters to mib; another thread may be updating them
+static void tcp_mib_add(tcp_mib_t *mib, const tcp_stack_t *stack) {
+    uint64_t *dst = (uint64_t *)mib;
+    const uint64_t *src = (const uint64_t *)&stack->mib;
     
-    if (sock->state != TCP_ESTABLISHED) {
-        errno = ENOTCONN;
-        return -1;
+    for (size_t i = 0; i < sizeof(tcp_mib_t) / sizeof(uint64_t); i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Snapshot of a stack's counters, or of the sum over every stack that
+// exists (stack = NULL). Safe from any thread.
+void tcp_stack_mib(tcp_stack_t *stack, tcp_mib_t *mib) {
+    memset(mib, 0, sizeof(*mib));
+    if (stack) {
+        tcp_mib_add(mib, stack);
+        return;
     }
     
-    // Send data in chunks if necessary
-    size_t sent = 0;
-    while (sent < len) {
-        size_t chunk_size = (len - sent) > TCP_MSS ? TCP_MSS : (len - sent);
-        
-        if (send_tcp_packet(sock, TCP_PSH | TCP_ACK, (uint8_t *)buf + sent, chunk_size) < 0) {
-            return -1;
+    pthread_mutex_lock(&stack_lock);
+    for (int i = 0; i < TCP_MAX_STACKS; i++) {
+        if (stack_table[i]) {
+            tcp_mib_add(mib, stack_table[i]);
         }
-        
-        sock->send_seq += chunk_size;
-        sent += chunk_size;
-        
-        // Wait for ACK
-        struct tcp_header tcph;
-        uint8_t data[TCP_MSS];
-        size_t data_len;
-        
-        if (recv_tcp_packet(sock, &tcph, data, &data_len, 2) < 0) {
-            // Timeout, but we're not implementing retransmission
-            printf("Warning: ACK timeout, continuing anyway\n");
+    }
+    pthread_mutex_unlock(&stack_lock);
+}
+
+// Create a readiness notification instance for the sockets of a stack
+int tcp_stack_epoll_create(tcp_stack_t *stack) {
+    for (int i = 0; i < MAX_EPOLL; i++) {
+        tcp_epoll_t *ep = &stack->epoll_table[i];
+        if (!ep->is_used) {
+            memset(ep, 0, sizeof(tcp_epoll_t));
+            ep->is_used = 1;
+            return (stack->id << TCP_STACK_SHIFT) | i;
         }
     }
     
-    return sent;
+    errno = EMFILE;
+    return -1;
 }
 
-// Receive data
-ssize_t tcp_recv(int sockfd, void *buf, size_t len, int flags) {
-    (void)flags; // Unused parameter
+// Create a readiness notification instance on the default stack
+int tcp_epoll_create(void) {
+    tcp_stack_t *stack = tcp_stack_default();
+    if (stack == NULL) {
+        return -1;
+    }
+    return tcp_stack_epoll_create(stack);
+}
+
+// tcp_epoll instance behind a descriptor; NULL with errno = EBADF if none
+static tcp_epoll_t *tcp_get_epoll(int epfd) {
+    tcp_stack_t *stack = tcp_fd_stack(epfd);
+    int i = TCP_FD_INDEX(epfd);
     
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
+    if (stack == NULL || i >= MAX_EPOLL || !stack->epoll_table[i].is_used) {
         errno = EBADF;
+        return NULL;
+    }
+    return &stack->epoll_table[i];
+}
+
+// Add, change or remove the events watched on a socket
+int tcp_epoll_ctl(int epfd, int op, int sockfd, tcp_epoll_event_t *event) {
+    if (tcp_get_epoll(epfd) == NULL) {
         return -1;
     }
     
-    tcp_socket_t *sock = &socket_table[sockfd];
-    
-    if (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT) {
-        errno = ENOTCONN;
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
         return -1;
     }
     
-    // Receive packet
-    struct tcp_header tcph;
-    uint8_t data[TCP_MSS];
-    size_t data_len;
-    
-    if (recv_tcp_packet(sock, &tcph, data, &data_len, 10) < 0) {
+    // An instance only watches sockets of its own stack
+    if (sock->stack != tcp_fd_stack(epfd)) {
+        errno = EINVAL;
         return -1;
     }
     
-    // Check for FIN
-    if (tcph.flags & TCP_FIN) {
-        printf("Received FIN\n");
-        sock->recv_seq = ntohl(tcph.seq_num) + 1;
-        
-        // Send ACK
-        send_tcp_packet(sock, TCP_ACK, NULL, 0);
-        
-        sock->state = TCP_CLOSE_WAIT;
-        return 0;  // Connection closing
+    if (op != TCP_EPOLL_CTL_DEL && event == NULL) {
+        errno = EFAULT;
+        return -1;
     }
     
-    // Copy data to user buffer
-    size_t copy_len = data_len < len ? data_len : len;
-    if (copy_len > 0) {
-        memcpy(buf, data, copy_len);
-        sock->recv_seq += data_len;
-        
-        // Send ACK
-        send_tcp_packet(sock, TCP_ACK, NULL, 0);
+    switch (op) {
+    case TCP_EPOLL_CTL_ADD:
+        if (sock->epfd >= 0) {
+            errno = EEXIST;
+            return -1;
+        }
+        sock->epfd = epfd;
+        break;
+    case TCP_EPOLL_CTL_MOD:
+    case TCP_EPOLL_CTL_DEL:
+        if (sock->epfd != epfd) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (op == TCP_EPOLL_CTL_DEL) {
+            tcp_ep_detach(sock);
+            return 0;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
     }
     
-    return copy_len;
+    sock->ep_events = event->events;
+    sock->ep_data = event->data;
+    
+    // The socket may already be ready
+    tcp_wakeup(sock);
+    
+    return 0;
 }
 
-// Close connection
-int tcp_close(int sockfd) {
-    if (sockfd < 0 || sockfd >= MAX_SOCKETS || !socket_table[sockfd].is_used) {
-        errno = EBADF;
+// Wait up to timeout_ms (-1 = forever, 0 = don't block) for watched sockets
+// to become ready. Readiness is level-triggered: a socket keeps being
+// reported while the condition holds. Returns the number of events stored.
+int tcp_epoll_wait(int epfd, tcp_epoll_event_t *events, int maxevents, int timeout_ms) {
+    tcp_epoll_t *ep = tcp_get_epoll(epfd);
+    if (ep == NULL) {
+        return -1;
+    }
+    if (events == NULL || maxevents <= 0) {
+        errno = EINVAL;
         return -1;
     }
     
-    tcp_socket_t *sock = &socket_table[sockfd];
+    tcp_stack_t *stack = tcp_fd_stack(epfd);
+    uint64_t deadline = timeout_ms >= 0 ? tcp_now_ms() + timeout_ms : UINT64_MAX;
     
-    if (sock->state == TCP_ESTABLISHED) {
-        printf("Closing connection...\n");
-        
-        // Send FIN
-        printf("Sending FIN...\n");
-        send_tcp_packet(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->state = TCP_FIN_WAIT_1;
-        
-        // Wait for ACK
-        struct tcp_header tcph;
-        uint8_t data[TCP_MSS];
-        size_t data_len;
-        
-        printf("Waiting for ACK...\n");
-        if (recv_tcp_packet(sock, &tcph, data, &data_len, 2) >= 0) {
-            if (tcph.flags & TCP_ACK) {
-                printf("Received ACK\n");
-                sock->state = TCP_FIN_WAIT_2;
+    while (1) {
+        // Check each queued socket once; those still ready go back on the list
+        int n = 0;
+        tcp_socket_t *last = ep->ready_tail;
+        while (n < maxevents && ep->ready_head) {
+            tcp_socket_t *sock = ep->ready_head;
+            ep->ready_head = sock->ep_next;
+            if (!ep->ready_head) {
+                ep->ready_tail = NULL;
             }
-        }
-        
-        // Wait for FIN
-        printf("Waiting for FIN...\n");
-        if (recv_tcp_packet(sock, &tcph, data, &data_len, 2) >= 0) {
-            if (tcph.flags & TCP_FIN) {
-                printf("Received FIN\n");
-                sock->recv_seq = ntohl(tcph.seq_num) + 1;
-                
-                // Send ACK
-                printf("Sending final ACK...\n");
-                send_tcp_packet(sock, TCP_ACK, NULL, 0);
-                
-                sock->state = TCP_TIME_WAIT;
+            sock->ep_queued = 0;
+            
+            uint32_t mask = tcp_poll_mask(sock) &
+                            (sock->ep_events | TCP_EPOLLERR | TCP_EPOLLHUP);
+            if (mask) {
+                events[n].events = mask;
+                events[n].data = sock->ep_data;
+                n++;
+                tcp_wakeup(sock);
+            }
+            
+            if (sock == last) {
+                break;
             }
         }
-    } else if (sock->state == TCP_CLOSE_WAIT) {
-        // Send FIN
-        printf("Sending FIN...\n");
-        send_tcp_packet(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->state = TCP_LAST_ACK;
         
-        // Wait for ACK
-        struct tcp_header tcph;
-        uint8_t data[TCP_MSS];
-        size_t data_len;
+        if (n > 0) {
+            return n;
+        }
         
-        printf("Waiting for final ACK...\n");
-        recv_tcp_packet(sock, &tcph, data, &data_len, 2);
+        uint64_t now = tcp_now_ms();
+        if (now >= deadline) {
+            return 0;
+        }
+        if (tcp_stack_poll(stack, deadline == UINT64_MAX ? -1 : (int)(deadline - now)) < 0) {
+            return -1;
+        }
     }
-    
-    // Close socket
-    if (sock->fd >= 0) {
-        close(sock->fd);
+}
+
+// Destroy a readiness notification instance
+int tcp_epoll_close(int epfd) {
+    tcp_epoll_t *ep = tcp_get_epoll(epfd);
+    if (ep == NULL) {
+        return -1;
     }
     
-    sock->is_used = 0;
-    sock->state = TCP_CLOSED;
-    
-    printf("Connection closed\n");
+    tcp_stack_t *stack = tcp_fd_stack(epfd);
+    for (int i = 0; i < stack->fd_table_size; i++) {
+        if (stack->fd_table[i] && stack->fd_table[i]->epfd == epfd) {
+            tcp_ep_detach(stack->fd_table[i]);
+        }
+    }
+    ep->is_used = 0;
     
     return 0;
 }
 
+// Get or set file status flags; only O_NONBLOCK is supported
+int tcp_fcntl(int sockfd, int cmd, ...) {
+    tcp_socket_t *sock = tcp_get_socket(sockfd);
+    if (sock == NULL) {
+        return -1;
+    }
+    
+    switch (cmd) {
+    case F_GETFL:
+        return O_RDWR | (sock->nonblock ? O_NONBLOCK : 0);
+    case F_SETFL: {
+        va_list ap;
+        va_start(ap, cmd);
+        int fl = va_arg(ap, int);
+        va_end(ap);
+        sock->nonblock = (fl & O_NONBLOCK) != 0;
+        return 0;
+    }
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
@@ -2,7 +2,9 @@
 #define TCP_LITE_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <net/if.h>
 
 // TCP States
 #define TCP_CLOSED       0
@@ -25,12 +27,120 @@
 #define TCP_ACK  0x10
 #define TCP_URG  0x20
 
+// TCP Option kinds
+#define TCP_OPT_EOL        0
+#define TCP_OPT_NOP        1
+#define TCP_OPT_MSS        2
+#define TCP_OPT_WSCALE     3
+#define TCP_OPT_SACK_PERM  4
+#define TCP_OPT_SACK       5
+#define TCP_OPT_TIMESTAMP  8
+
 // Constants
-#define MAX_SOCKETS      64
-#define MAX_PENDING_CONN 5
-#define TCP_BUFFER_SIZE  65536
+#define MAX_PENDING_CONN 5     // Default listen backlog
+#define TCP_BUFFER_SIZE  65536 // Default send and receive buffer size
+#define TCP_BUFFER_MIN   4096  // Smallest SO_SNDBUF / SO_RCVBUF
+#define TCP_BUFFER_MAX   (16 * 1024 * 1024)  // Largest SO_SNDBUF / SO_RCVBUF
+#define TCP_SLAB_SOCKETS 64    // Control blocks carved from each slab
+#define TCP_FD_TABLE_MIN 64    // Initial size of the descriptor table
+#define TCP_PKTBUF_HEADROOM 128  // Free bytes in front of a fresh packet buffer's data
+#define TCP_PKTBUF_CLASSES  4    // Packet buffer size classes (128 B to 64 KB of data)
+#define TCP_PKTBUF_CHUNK    (256 * 1024)  // Bytes a pool carves into buffers at a time
 #define TCP_WINDOW_SIZE  65535  // Max window size for uint16_t
-#define TCP_MSS          1460  // Maximum Segment Size
+#define TCP_MSS          1460  // Maximum Segment Size before negotiation
+#define TCP_MSS_DEFAULT  536   // Peer MSS when its SYN carries no MSS option
+#define TCP_MSS_MAX      65495 // Largest MSS we advertise (64 KB IP datagram)
+#define TCP_MSS_MIN      88    // Smallest peer MSS we honour (same floor as Linux)
+#define TCP_MAX_WSCALE   14    // Largest window scale shift (RFC 7323)
+#define TCP_PORT_EPHEMERAL 49152  // Lowest port given to a connect() without bind() (RFC 6335)
+
+// Retransmission (RFC 6298 / RFC 5681)
+#define TCP_RTO_INITIAL  1000  // Initial retransmission timeout (ms)
+#define TCP_RTO_MIN      200   // Lower bound on the RTO (ms)
+#define TCP_RTO_MAX      60000 // Upper bound on the RTO after backoff (ms)
+#define TCP_MAX_RETRIES  12    // Retransmissions before the connection is dropped
+#define TCP_DUPACK_THRESHOLD 3 // Duplicate ACKs that trigger fast retransmit
+
+// Reassembly
+#define TCP_MAX_OOO_RANGES 32  // Out-of-order byte ranges held per connection
+#define TCP_MAX_SACK_BLOCKS 4  // SACK blocks that fit in the option space (RFC 2018)
+
+// Delayed ACKs (RFC 1122 4.2.3.2)
+#define TCP_DELACK_TIMEOUT 40  // Longest an ACK is held back (ms)
+
+// Connection timers, kept on a per-stack timer wheel with 1 ms ticks
+#define TCP_TIMER_RTO       0  // Retransmission
+#define TCP_TIMER_DELACK    1  // Delayed ACK
+#define TCP_TIMER_PERSIST   2  // Zero-window probe (RFC 9293 3.8.6.1)
+#define TCP_TIMER_KEEPALIVE 3  // Keepalive probe (RFC 1122 4.2.3.6)
+#define TCP_TIMER_TIMEWAIT  4  // 2MSL wait in TIME_WAIT, FIN_WAIT_2 limit of a closed connection
+#define TCP_TIMER_COUNT     5
+#define TCP_WHEEL_SLOTS     64 // Slots per wheel level (one bit each in a 64-bit mask)
+#define TCP_WHEEL_LEVELS    4  // Levels: the wheel reaches 64^4 ms (4.6 hours) ahead
+#define TCP_MSL          30000 // Maximum segment lifetime (ms); TIME_WAIT lasts 2 * TCP_MSL
+#define TCP_FIN_TIMEOUT  60000 // Longest a closed connection waits for the peer's FIN (ms)
+#define TCP_LINGER_TIMEOUT 60000 // Longest a blocking close waits for queued data to be acked (ms)
+
+// Keepalive defaults (RFC 1122 4.2.3.6) and limits, in seconds and probes
+#define TCP_KEEPIDLE_DEFAULT  7200  // Idle time before the first probe
+#define TCP_KEEPINTVL_DEFAULT 75    // Time between unanswered probes
+#define TCP_KEEPCNT_DEFAULT   9     // Unanswered probes before the connection is dropped
+#define TCP_KEEPTIME_MAX      32767 // Largest TCP_KEEPIDLE / TCP_KEEPINTVL
+#define TCP_KEEPCNT_MAX       127   // Largest TCP_KEEPCNT
+
+// Packet dispatch
+#define TCP_HASH_SIZE    256   // Connection and listener hash buckets (power of two)
+#define TCP_RX_BATCH     64    // Packets a backend takes in per receive call
+#define TCP_TX_BATCH     64    // Segments handed to a backend per transmit call
+#define TCP_RAW_RCVBUF   (4 * 1024 * 1024)  // Kernel queue for the shared raw socket
+
+// Stack instances
+#define TCP_MAX_STACKS   64    // Stack instances per process
+#define TCP_STACK_SHIFT  20    // Descriptor bits below the stack id (descriptors per stack)
+#define TCP_FD_INDEX(fd) ((fd) & ((1 << TCP_STACK_SHIFT) - 1))  // Table index of a descriptor
+#define TCP_FD_STACK(fd) ((fd) >> TCP_STACK_SHIFT)                // Stack id of a descriptor
+#define TCP_MTU_DEFAULT  1500  // Link MTU of a stack with its own address
+#define TCP_MEM_RING     256   // Packets queued on each side of a memory link (power of two)
+#define TCP_NETEM_LIMIT  1000  // Packets an impaired memory link holds in flight by default
+#define TCP_ROUTE_CACHE  64    // Kernel routes a stack remembers, by peer (power of two)
+#define TCP_ROUTE_TTL    1000  // How long a remembered route is used (ms)
+
+// Receive backends of the default stack, chosen with tcp_init_rx() before the first socket
+#define TCP_RX_RAW          0  // recvmmsg() on the raw socket (default)
+#define TCP_RX_PACKET_MMAP  1  // AF_PACKET TPACKET_V3 ring shared with the kernel
+#define TCP_RING_BLOCK_SIZE (256 * 1024)  // Bytes per ring block (holds a 64 KB frame)
+#define TCP_RING_BLOCKS     16            // Blocks in the ring
+#define TCP_RING_RETIRE_MS  1             // Longest the kernel holds a partly filled block
+
+// Readiness notification (values match Linux <sys/epoll.h>)
+#define MAX_EPOLL        16    // tcp_epoll instances per stack
+#define TCP_EPOLLIN      0x001 // Data or EOF to read, or a connection to accept
+#define TCP_EPOLLOUT     0x004 // Room in the send window
+#define TCP_EPOLLERR     0x008 // Connection dropped (always reported)
+#define TCP_EPOLLHUP     0x010 // Both directions shut down (always reported)
+#define TCP_EPOLL_CTL_ADD 1
+#define TCP_EPOLL_CTL_DEL 2
+#define TCP_EPOLL_CTL_MOD 3
+
+// Congestion control
+#define TCP_CC_DEFAULT   "cubic"  // Algorithm used by new sockets
+#define TCP_CC_NAME_MAX  16       // Longest algorithm name, including the NUL
+
+// Socket options (values match Linux <netinet/tcp.h>)
+#ifndef TCP_NODELAY
+#define TCP_NODELAY      1     // Send small segments at once, without Nagle's algorithm (int)
+#endif
+#ifndef TCP_CORK
+#define TCP_CORK         3     // Hold partial segments until cleared (int)
+#endif
+#ifndef TCP_KEEPIDLE
+#define TCP_KEEPIDLE     4     // Idle seconds before keepalive probes start (int)
+#define TCP_KEEPINTVL    5     // Seconds between keepalive probes (int)
+#define TCP_KEEPCNT      6     // Keepalive probes before dropping the connection (int)
+#endif
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION   13    // Congestion control algorithm (string)
+#endif
 
 // TCP Header (20 bytes without options)
 struct tcp_header {
@@ -68,25 +178,389 @@ struct pseudo_header {
     uint16_t tcp_length;
 } __attribute__((packed));
 
+struct tcp_pktpool;
+
+// Packet buffer from a stack's pool. Buffers are reference counted, so one
+// can sit on the retransmission queue and the transmit batch at once; it
+// goes back to the pool when its last holder frees it. A packet may span
+// a chain of buffers linked through next.
+typedef struct tcp_pktbuf {
+    struct tcp_pktbuf *next;          // Next buffer of the packet (free list link while free)
+    struct tcp_pktpool *pool;         // Pool it returns to
+    uint8_t *data;                    // First byte of the contents
+    uint32_t len;                     // Bytes of contents
+    uint32_t size;                    // Bytes in buf: headroom plus the class size
+    uint32_t refs;                    // Holders
+    uint8_t  cls;                     // Size class
+    uint64_t cb[6];                   // Owner's state (tcp_segment_t on the retransmission queue)
+    uint8_t  buf[];
+} tcp_pktbuf_t;
+
+// Free lists of packet buffers, one per size class. Buffers are carved
+// from TCP_PKTBUF_CHUNK allocations that stay with the pool until it is
+// destroyed, so a stack in steady state does not call malloc().
+typedef struct tcp_pktpool {
+    tcp_pktbuf_t *free[TCP_PKTBUF_CLASSES];
+    struct tcp_pktchunk *chunks;
+} tcp_pktpool_t;
+
+// Sent segment held on the retransmission queue until it is acknowledged.
+// It lives in the control area of the buffer that holds its payload.
+typedef struct tcp_segment {
+    struct tcp_segment *next;
+    tcp_pktbuf_t *pb;                 // Buffer it lives in; its contents are the payload
+    uint32_t seq;                     // First sequence number
+    uint32_t len;                     // Payload length (the buffer's len)
+    uint8_t  flags;                   // TCP flags it was sent with
+    int      retransmits;             // Times this segment was resent
+    int      sacked;                  // Reported received by a SACK block
+    int      lost;                    // Deemed lost by the SACK scoreboard
+    uint64_t sent_us;                 // Time of the last transmission
+} tcp_segment_t;
+
+// Timer on a stack's timer wheel
+typedef struct tcp_timer {
+    struct tcp_timer *next;
+    struct tcp_timer **pprev;         // Link pointing here, NULL while stopped
+    uint64_t expires;                 // Tick it fires at (ms, monotonic clock)
+    uint16_t slot;                    // Wheel slot while pending
+    uint8_t kind;                     // TCP_TIMER_* index in the socket's timers
+} tcp_timer_t;
+
+// Hierarchical timer wheel: each slot of level n covers 64^n ticks, and
+// a slot's timers move down a level when its first tick comes up
+typedef struct tcp_timer_wheel {
+    uint64_t now;                     // Next tick to process (ms)
+    uint64_t occupied[TCP_WHEEL_LEVELS];  // Non-empty slots of each level
+    tcp_timer_t *slots[TCP_WHEEL_LEVELS][TCP_WHEEL_SLOTS];
+} tcp_timer_wheel_t;
+
+struct tcp_socket;
+
+// Congestion control algorithm. cwnd and ssthresh live in the socket; any
+// other per-connection state goes in the socket's cc_priv area.
+typedef struct tcp_cc_ops {
+    const char *name;
+    void (*init)(struct tcp_socket *sock);
+    void (*on_ack)(struct tcp_socket *sock, uint32_t acked);  // New data acked outside recovery
+    void (*on_loss)(struct tcp_socket *sock);  // Loss detected by duplicate ACKs
+    void (*on_rto)(struct tcp_socket *sock);   // Retransmission timeout
+} tcp_cc_ops_t;
+
+// Event reported by tcp_epoll_wait()
+typedef struct tcp_epoll_event {
+    uint32_t events;                  // TCP_EPOLL* mask
+    uint64_t data;                    // Caller's cookie from tcp_epoll_ctl()
+} tcp_epoll_event_t;
+
+// tcp_epoll instance: sockets whose state changed wait on its ready list
+typedef struct tcp_epoll {
+    int is_used;
+    struct tcp_socket *ready_head;
+    struct tcp_socket *ready_tail;
+} tcp_epoll_t;
+
+// Outgoing packet on a stack's transmit batch. The IP and TCP headers are
+// built in the headroom of the payload's buffer when nothing else holds
+// it, otherwise in hdr; the payload is referenced, not copied.
+typedef struct tcp_pkt {
+    uint8_t hdr[sizeof(struct ip_header) + sizeof(struct tcp_header) + 40];
+    struct iovec iov[2];              // Headers, then the payload if it is not behind them
+    int iovcnt;
+    uint32_t dst_addr;                // Destination (network order)
+    tcp_pktbuf_t *pb;                 // Payload buffer, held until the batch is flushed
+} tcp_pkt_t;
+
+typedef struct tcp_stack tcp_stack_t;
+
+// What a backend knows about the checksum of a received packet
+#define TCP_RX_CSUM_PARTIAL 0x01      // May hold only the pseudo-header sum left to offload
+#define TCP_RX_CSUM_VALID   0x02      // Already verified by the kernel
+
+// Link-layer backend: carries whole IPv4 packets between a stack and the
+// network. Received packets are handed to tcp_stack_input(), or to
+// tcp_stack_input_flags() with TCP_RX_* flags.
+typedef struct tcp_backend_ops {
+    const char *name;
+    int (*open)(tcp_stack_t *stack);   // Set up backend_priv; -1 with errno set on failure
+    void (*close)(tcp_stack_t *stack);
+    void (*xmit)(tcp_stack_t *stack, const tcp_pkt_t *pkts, int n);  // Drops what it cannot send
+    int (*wait)(tcp_stack_t *stack, int timeout_ms);  // >0 once packets may be waiting, 0 on timeout, -1 on error
+    int (*rx)(tcp_stack_t *stack);     // Deliver what has arrived; number delivered, -1 on error
+} tcp_backend_ops_t;
+
+// Parameters of tcp_stack_create(); zero fields take the defaults
+typedef struct tcp_stack_config {
+    const tcp_backend_ops_t *backend; // Packet I/O (NULL = raw socket)
+    const char *ifname;               // Interface for the packet ring or TUN device
+    uint32_t addr;                    // Our IPv4 address (network order), 0 = the kernel's
+    int mtu;                          // Link MTU when addr is set (0 = TCP_MTU_DEFAULT)
+    int shard;                        // Partition of the link's flows this stack owns
+    int shards;                       // Stacks sharing the link (0 or 1 = not sharded)
+} tcp_stack_config_t;
+
+// Impairments a memory link applies to what one side sends, after Linux
+// netem; zero fields are off. The draws come from a generator seeded with
+// seed, so a run can be repeated.
+typedef struct tcp_netem {
+    uint32_t delay_us;                // One-way delay
+    uint32_t jitter_us;               // Extra delay drawn from [0, jitter_us); reorders packets
+    double loss;                      // Probability of dropping a packet
+    double reorder;                   // Probability of a packet skipping the delay
+    uint64_t rate_bps;                // Link bandwidth in bits per second (0 = unlimited)
+    uint32_t limit;                   // Packets in flight before drops (0 = TCP_NETEM_LIMIT)
+    uint32_t seed;
+} tcp_netem_t;
+
+// State and counters of one connection, filled in by tcp_getinfo()
+// (after Linux's struct tcp_info)
+typedef struct tcp_conn_info {
+    int state;                        // TCP state
+    uint32_t srtt_us;                 // Smoothed round-trip time
+    uint32_t rttvar_us;               // Round-trip time variation
+    uint32_t rto_ms;                  // Current retransmission timeout
+    uint32_t mss;                     // Payload bytes per full-sized segment we send
+    uint32_t cwnd;                    // Congestion window (bytes)
+    uint32_t ssthresh;                // Slow start threshold (bytes)
+    uint32_t snd_wnd;                 // Peer's advertised receive window
+    uint32_t unacked;                 // Sequence space sent and not acknowledged
+    uint32_t snd_queued;              // Bytes in the send buffer not sent yet
+    uint32_t rcv_queued;              // Bytes received and not read yet
+    int in_recovery;                  // In fast recovery
+    uint64_t bytes_sent;              // Payload bytes sent, retransmissions included
+    uint64_t bytes_retrans;           // Payload bytes retransmitted
+    uint64_t bytes_acked;             // Sequence space acknowledged by the peer
+    uint64_t bytes_received;          // Payload bytes received in order
+    uint64_t segs_out;                // Segments sent, pure ACKs included
+    uint64_t segs_in;                 // Segments received
+    uint32_t retrans_segs;            // Segments retransmitted
+    uint32_t timeouts;                // Retransmission timeouts
+    uint32_t dupacks;                 // Duplicate ACKs received
+    uint32_t ooo_segs;                // Segments received out of order
+} tcp_conn_info_t;
+
+// Stack-wide counters (after the Linux TCP MIB). Every stack keeps its own,
+// written only by the thread that drives it, so counting costs a plain
+// increment; tcp_stack_mib() reads them from any thread.
+typedef struct tcp_mib {
+    uint64_t in_packets;              // Packets the backend delivered
+    uint64_t in_segs;                 // Segments handed to a connection or listener
+    uint64_t in_discards;             // Packets that are not IPv4 TCP
+    uint64_t in_errs;                 // Truncated or malformed headers
+    uint64_t in_csum_errs;            // TCP checksum failures
+    uint64_t in_no_socket;            // Demux misses: no connection or listener for the segment
+    uint64_t in_window_drops;         // Payload beyond the receive window, or with no room to hold or track it
+    uint64_t listen_drops;            // SYNs dropped by a full listen queue
+    uint64_t out_segs;                // Segments sent, retransmissions included
+    uint64_t retrans_segs;            // Segments retransmitted
+    uint64_t timeouts;                // Retransmission timeouts
+    uint64_t active_opens;            // Connections started by tcp_connect()
+    uint64_t passive_opens;           // Connections started by a listener
+    uint64_t conn_drops;              // Connections dropped by the retransmission or keepalive limit
+} tcp_mib_t;
+
+// Range of sequence numbers [start, end)
+typedef struct tcp_seq_range {
+    uint32_t start;
+    uint32_t end;
+} tcp_seq_range_t;
+
 // TCP Socket Control Block
 typedef struct tcp_socket {
-    int fd;                           // Raw socket file descriptor
     int state;                        // TCP state
-    int is_used;                      // Socket slot in use
+    int sockfd;                       // Descriptor handed to the application
+    tcp_stack_t *stack;               // Stack instance the socket lives in
+    int so_error;                     // Why the connection was dropped (errno value)
+    
+    struct tcp_socket *hash_next;     // Next control block in the same hash bucket
+    int hashed;                       // Reachable by the RX dispatcher
     
     struct sockaddr_in local_addr;    // Local address and port
     struct sockaddr_in remote_addr;   // Remote address and port
     
-    uint32_t send_seq;                // Send sequence number
+    uint32_t snd_una;                 // Oldest unacknowledged sequence number
+    uint32_t snd_nxt;                 // Next sequence number to send
+    uint32_t snd_wnd;                 // Peer's advertised receive window
+    uint32_t snd_wl1;                 // Sequence number of the segment that set snd_wnd
+    uint32_t snd_wl2;                 // Acknowledgment number of that segment
     uint32_t recv_seq;                // Expected receive sequence number
     
-    uint8_t recv_buffer[TCP_BUFFER_SIZE];
-    int recv_len;
+    tcp_segment_t *rtx_head;          // Retransmission queue (oldest first)
+    tcp_segment_t *rtx_tail;
+    uint32_t srtt_us;                 // Smoothed round-trip time
+    uint32_t rttvar_us;               // Round-trip time variation
+    uint32_t rto_ms;                  // Current retransmission timeout
+    int dupacks;                      // Consecutive duplicate ACKs
+    
+    // Send ring: bytes accepted by tcp_send() that have not been sent yet.
+    // Allocated by the first tcp_send().
+    uint8_t *send_buffer;
+    uint32_t sndbuf_size;             // Capacity of send_buffer
+    uint32_t snd_len;                 // Unsent bytes in send_buffer
+    uint32_t snd_head;                // Oldest unsent byte in send_buffer
+    int fin_queued;                   // A non-blocking tcp_close() left a FIN to follow it
+    
+    // Small segments: under Nagle's algorithm (RFC 896), in Minshall's
+    // variant, one shorter than the MSS waits while an earlier short one
+    // is unacknowledged
+    int nodelay;                      // TCP_NODELAY: Nagle's algorithm off
+    int cork;                         // TCP_CORK: only full-sized segments until cleared
+    uint32_t snd_sml;                 // End of the last short segment sent
+    
+    // Receive ring: in-order bytes start at recv_head, out-of-order bytes
+    // are stored at their offset past the in-order data until the gap fills.
+    // Allocated when the first payload byte arrives.
+    uint8_t *recv_buffer;
+    uint32_t rcvbuf_size;             // Capacity of recv_buffer
+    int recv_len;                     // In-order bytes ready for tcp_recv
+    int recv_head;                    // Read position in recv_buffer
+    int recv_lent;                    // Bytes at recv_head lent out by tcp_recv_zc()
+    tcp_seq_range_t ooo[TCP_MAX_OOO_RANGES];  // Out-of-order ranges, sorted
+    int ooo_count;
+    uint32_t sack_recent;             // Start of the latest out-of-order segment
+    uint32_t rcv_adv;                 // Right edge of the last advertised window
+    int fin_received;                 // Peer's FIN has been consumed
+    uint32_t ack_pending;             // Bytes received but not yet acknowledged
+    
+    const tcp_cc_ops_t *cc;           // Congestion control algorithm
+    uint32_t cwnd;                    // Congestion window (bytes)
+    uint32_t ssthresh;                // Slow start threshold (bytes)
+    uint64_t cc_priv[8];              // Algorithm-private state
+    int in_recovery;                  // In fast recovery (RFC 6582)
+    uint32_t recover;                 // snd_nxt when loss recovery started
+    int rxt_active;                   // Resending the window after an RTO
+    uint32_t rxt_next;                // Next sequence number to resend after an RTO
+    uint32_t high_rxt;                // End of the last hole resent in SACK recovery
+    
+    // SACK scoreboard (RFC 6675), updated as blocks arrive and segments are
+    // acked. Unsacked segments below the hole cursor are the lost ones.
+    uint32_t sacked_bytes;            // SACKed sequence space on the queue
+    uint32_t sacked_segs;             // SACKed segments on the queue
+    uint32_t lost_bytes;              // Unsacked space deemed lost
+    uint32_t rxt_bytes;               // Unsacked space below high_rxt (resent)
+    tcp_segment_t *sack_hole;         // First segment not yet deemed lost or passed as SACKed
+    tcp_segment_t *rxt_hint;          // Where the search for the next hole to resend resumes
+    uint32_t hole_sacked_bytes;       // SACKed space from the cursor up
+    uint32_t hole_sacked_segs;        // SACKed segments from the cursor up
+    
+    // Negotiated options (RFC 6691, RFC 7323, RFC 2018)
+    uint16_t mss;                     // Payload bytes per full-sized segment we send
+    uint16_t adv_mss;                 // MSS we advertise, from the route MTU
+    uint8_t snd_wscale;               // Shift applied to the peer's window
+    uint8_t rcv_wscale;               // Shift applied to the window we advertise
+    int ws_ok;                        // Window scaling in use
+    int ts_ok;                        // Timestamps in use
+    int sack_ok;                      // Selective acknowledgments in use (RFC 2018)
+    uint32_t ts_recent;               // Peer's latest timestamp, echoed back
     
+    tcp_timer_t timers[TCP_TIMER_COUNT];  // Indexed by TCP_TIMER_*
+    
+    // Counters reported by tcp_getinfo()
+    uint64_t bytes_sent;              // Payload bytes sent, retransmissions included
+    uint64_t bytes_retrans;           // Payload bytes retransmitted
+    uint64_t bytes_acked;             // Sequence space acknowledged by the peer
+    uint64_t bytes_received;          // Payload bytes received in order
+    uint64_t segs_out;                // Segments sent
+    uint64_t segs_in;                 // Segments received
+    uint32_t retrans_segs;            // Segments retransmitted
+    uint32_t timeouts;                // Retransmission timeouts
+    uint32_t dupacks_in;              // Duplicate ACKs received
+    uint32_t ooo_segs;                // Segments received out of order
+    uint32_t persist_ms;              // Current zero-window probe interval
+    int persist_probes;               // Zero-window probes since the peer last answered
+    
+    // Keepalive: probes go out once the peer has been silent for keep_idle
+    int keepalive;                    // SO_KEEPALIVE set
+    int keep_idle;                    // TCP_KEEPIDLE (s)
+    int keep_intvl;                   // TCP_KEEPINTVL (s)
+    int keep_cnt;                     // TCP_KEEPCNT
+    int keep_probes;                  // Probes sent since the peer was last heard from
+    uint64_t rcv_tstamp;              // When the peer was last heard from (ms)
+    
+    int nonblock;                     // O_NONBLOCK set with tcp_fcntl()
     int listening;                    // Is this a listening socket
-    int backlog;                      // Listen backlog
+    int backlog;                      // Listen backlog: limit of each queue below
+    
+    // Listener: half-open connections and connections ready for tcp_accept()
+    struct tcp_socket *syn_head;      // SYN queue (SYN-RCVD), unordered
+    int syn_qlen;
+    struct tcp_socket *accept_head;   // Accept queue, oldest first
+    struct tcp_socket *accept_tail;
+    int accept_qlen;
+    
+    // Connection created by a listener and not accepted yet
+    struct tcp_socket *parent;        // Listener, NULL otherwise
+    int accept_queued;                // On the accept queue rather than the SYN queue
+    struct tcp_socket *queue_next;    // Next entry in the listener's queue
+    
+    // tcp_epoll registration (a socket belongs to at most one instance)
+    int epfd;                         // Instance watching this socket, -1 if none
+    uint32_t ep_events;               // Events of interest
+    uint64_t ep_data;                 // Cookie returned with events
+    struct tcp_socket *ep_next;       // Next socket on the instance's ready list
+    int ep_queued;                    // On the ready list
 } tcp_socket_t;
 
+// Route to a peer as the kernel reported it, remembered for TCP_ROUTE_TTL
+typedef struct tcp_route {
+    uint32_t daddr;                   // Peer (network order)
+    uint32_t saddr;                   // Local address the kernel sends from
+    uint16_t adv_mss;                 // MSS from the outgoing interface's MTU
+    uint64_t expires;                 // tcp_now_ms() from which it is asked again
+} tcp_route_t;
+
+// Stack instance: the connections, listeners and tcp_epoll instances that
+// share one backend, driven by one thread. Nothing in it is shared with
+// other stacks, so stacks on different threads need no locking.
+// Descriptors carry the stack id above TCP_STACK_SHIFT, so the default
+// stack (id 0) hands out small ones.
+struct tcp_stack {
+    int id;                           // Slot in the stack table
+    const tcp_backend_ops_t *backend;
+    void *backend_priv;               // Backend state
+    char ifname[IF_NAMESIZE];         // Interface the backend is bound to, "" = any
+    uint32_t addr;                    // Own IPv4 address (network order), 0 = the kernel's
+    int mtu;                          // Link MTU when addr is set
+    int shard;                        // Flows with tcp_flow_shard() == shard are ours
+    int shards;                       // Stacks sharing the link, 1 if not sharded
+    uint32_t rand_state;              // Random numbers for ISNs and ports
+    uint16_t ip_id;                   // IP identification of the next packet
+    
+    // Control blocks are carved from slabs; the descriptor table grows by
+    // doubling and released descriptors sit on a stack for reuse
+    struct tcp_slab *slab_list;
+    tcp_socket_t *sock_free_list;
+    tcp_socket_t **fd_table;
+    int *fd_free;
+    int fd_table_size;
+    int fd_free_count;
+    
+    // Connections by 4-tuple and listeners by local port, for RX dispatch
+    tcp_socket_t *conn_hash[TCP_HASH_SIZE];
+    tcp_socket_t *listen_hash[TCP_HASH_SIZE];
+    
+    // Routes the kernel gave a stack without an address of its own
+    tcp_route_t routes[TCP_ROUTE_CACHE];
+    
+    tcp_epoll_t epoll_table[MAX_EPOLL];
+    tcp_timer_wheel_t timers;         // Timers of every connection
+    
+    // Packet buffers for the retransmission queue and the backend
+    tcp_pktpool_t pktpool;
+    
+    tcp_mib_t mib;                    // Stack-wide counters
+    
+    // Transmit batch: handed to the backend in one call per flush. Each
+    // packet holds a reference on its payload buffer until then.
+    tcp_pkt_t tx_batch[TCP_TX_BATCH];
+    int tx_count;
+    
+    // Submission/completion rings of application threads (tcp_ring.c)
+    struct tcp_ring *rings;
+    int wake_fd;                      // eventfd the rings signal, -1 until the first ring
+    int wake_idle;                    // Stack thread may sleep: submitters signal wake_fd
+};
+
 // API Functions
 int tcp_socket(void);
 int tcp_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
@@ -97,10 +571,54 @@ ssize_t tcp_send(int sockfd, const void *buf, size_t len, int flags);
 ssize_t tcp_recv(int sockfd, void *buf, size_t len, int flags);
 int tcp_close(int sockfd);
 
+// Zero-copy receive: lend received data in place in the receive buffer
+// and give it back once done with it. tcp_sendv() forwards it as is.
+ssize_t tcp_recv_zc(int sockfd, struct iovec *iov, int *iovcnt, int flags);
+int tcp_recv_release(int sockfd, size_t len);
+ssize_t tcp_sendv(int sockfd, const struct iovec *iov, int iovcnt, int flags);
+int tcp_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
+int tcp_getsockopt(int sockfd, int level, int optname, void *optval, socklen_t *optlen);
+int tcp_fcntl(int sockfd, int cmd, ...);
+
+// Statistics: a connection's state and counters, and the counters of a
+// stack (NULL = the sum over every stack)
+int tcp_getinfo(int sockfd, tcp_conn_info_t *info);
+void tcp_stack_mib(tcp_stack_t *stack, tcp_mib_t *mib);
+
+// Readiness notification for many sockets from one thread
+int tcp_epoll_create(void);
+int tcp_epoll_ctl(int epfd, int op, int sockfd, tcp_epoll_event_t *event);
+int tcp_epoll_wait(int epfd, tcp_epoll_event_t *events, int maxevents, int timeout_ms);
+int tcp_epoll_close(int epfd);
+
 // Utility functions
 uint16_t tcp_checksum(const void *buf, size_t len);
 uint16_t ip_checksum(const void *buf, size_t len);
 void tcp_init(void);
+int tcp_init_rx(int backend, const char *ifname);
+
+// Stack instances. tcp_socket() and tcp_epoll_create() use the default
+// stack; sockets of other stacks come from tcp_stack_socket().
+tcp_stack_t *tcp_stack_create(const tcp_stack_config_t *config);
+void tcp_stack_destroy(tcp_stack_t *stack);
+tcp_stack_t *tcp_stack_default(void);
+int tcp_stack_socket(tcp_stack_t *stack);
+int tcp_stack_epoll_create(tcp_stack_t *stack);
+int tcp_stack_poll(tcp_stack_t *stack, int timeout_ms);
+int tcp_stack_input(tcp_stack_t *stack, const uint8_t *pkt, int len);
+int tcp_stack_input_flags(tcp_stack_t *stack, const uint8_t *pkt, int len, int flags);
+
+// For the thread driving a stack (such as tcp_ring.c's): tcp_send() and
+// tcp_recv() that never poll the stack. They only queue what fits or read
+// what is buffered, failing with EAGAIN otherwise; queued segments leave
+// with the thread's next tcp_stack_poll().
+ssize_t tcp_stack_send(int sockfd, const void *buf, size_t len, int flags);
+ssize_t tcp_stack_recv(int sockfd, void *buf, size_t len, int flags);
+
+// Sharded mode: count stacks share one link, each owning the flows that
+// hash to it and driven by a thread of its own
+int tcp_shards_create(const tcp_stack_config_t *config, int count, tcp_stack_t **stacks);
+int tcp_flow_shard(uint32_t saddr, uint16_t sport, uint32_t daddr, uint16_t dport, int shards);
 
 #endif // TCP_LITE_H
 
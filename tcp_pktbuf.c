@@ -0,0 +1,95 @@
+#include "tcp_pktbuf.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+
+// Bytes of data each class holds after the headroom: control segments,
+// an Ethernet MTU, jumbo-sized segments and whole 64 KB datagrams
+static const uint32_t class_size[TCP_PKTBUF_CLASSES] = { 128, 2048, 16384, 65536 };
+
+// Allocation carved into buffers of one class
+struct tcp_pktchunk {
+    struct tcp_pktchunk *next;
+};
+
+// Distance between buffers in a chunk, keeping each on its own cache lines
+static size_t pktbuf_stride(int cls) {
+    size_t bytes = sizeof(tcp_pktbuf_t) + TCP_PKTBUF_HEADROOM + class_size[cls];
+    return (bytes + 63) & ~(size_t)63;
+}
+
+// Carve a new chunk into free buffers of class cls
+static int pktpool_grow(tcp_pktpool_t *pool, int cls) {
+    size_t stride = pktbuf_stride(cls);
+    size_t count = TCP_PKTBUF_CHUNK / stride;
+    if (count == 0) {
+        count = 1;
+    }
+    
+    struct tcp_pktchunk *chunk;
+    if (posix_memalign((void **)&chunk, 64, 64 + count * stride) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    
+    uint8_t *base = (uint8_t *)chunk + 64;
+    for (size_t i = count; i-- > 0; ) {
+        tcp_pktbuf_t *pb = (tcp_pktbuf_t *)(base + i * stride);
+        pb->pool = pool;
+        pb->size = TCP_PKTBUF_HEADROOM + class_size[cls];
+        pb->cls = cls;
+        pb->next = pool->free[cls];
+        pool->free[cls] = pb;
+    }
+    return 0;
+}
+
+void tcp_pktpool_init(tcp_pktpool_t *pool) {
+    for (int i = 0; i < TCP_PKTBUF_CLASSES; i++) {
+        pool->free[i] = NULL;
+    }
+    pool->chunks = NULL;
+}
+
+void tcp_pktpool_destroy(tcp_pktpool_t *pool) {
+    while (pool->chunks) {
+        struct tcp_pktchunk *chunk = pool->chunks;
+        pool->chunks = chunk->next;
+        free(chunk);
+    }
+    tcp_pktpool_init(pool);
+}
+
+tcp_pktbuf_t *tcp_pktbuf_alloc(tcp_pktpool_t *pool, uint32_t size) {
+    int cls = 0;
+    while (cls < TCP_PKTBUF_CLASSES && class_size[cls] < size) {
+        cls++;
+    }
+    if (cls == TCP_PKTBUF_CLASSES) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    if (pool->free[cls] == NULL && pktpool_grow(pool, cls) < 0) {
+        return NULL;
+    }
+    
+    tcp_pktbuf_t *pb = pool->free[cls];
+    pool->free[cls] = pb->next;
+    pb->next = NULL;
+    pb->data = pb->buf + TCP_PKTBUF_HEADROOM;
+    pb->len = 0;
+    pb->refs = 1;
+    return pb;
+}
+
+void tcp_pktbuf_free(tcp_pktbuf_t *pb) {
+    while (pb && --pb->refs == 0) {
+        tcp_pktbuf_t *next = pb->next;
+        tcp_pktpool_t *pool = pb->pool;
+        pb->next = pool->free[pb->cls];
+        pool->free[pb->cls] = pb;
+        pb = next;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef TCP_PKTBUF_H
+#define TCP_PKTBUF_H
+
+#include "tcp_lite.h"
+
+// Reference-counted packet buffers in size classes, taken from a stack's
+// pool. A fresh buffer has TCP_PKTBUF_HEADROOM bytes free in front of its
+// data so headers can be prepended in place. A pool belongs to the thread
+// driving its stack: nothing here is locked or atomic.
+
+void tcp_pktpool_init(tcp_pktpool_t *pool);
+
+// Release every chunk of the pool, including buffers still held
+void tcp_pktpool_destroy(tcp_pktpool_t *pool);
+
+// Empty buffer of the smallest class holding size bytes after the
+// headroom, with one reference. NULL with errno set if size is larger
+// than every class or memory runs out.
+tcp_pktbuf_t *tcp_pktbuf_alloc(tcp_pktpool_t *pool, uint32_t size);
+
+// Drop a reference to a chain; buffers nobody holds go back to the pool.
+// Each buffer holds a reference on the next one.
+void tcp_pktbuf_free(tcp_pktbuf_t *pb);
+
+static inline tcp_pktbuf_t *tcp_pktbuf_ref(tcp_pktbuf_t *pb) {
+    pb->refs++;
+    return pb;
+}
+
+static inline uint32_t tcp_pktbuf_headroom(const tcp_pktbuf_t *pb) {
+    return pb->data - pb->buf;
+}
+
+static inline uint32_t tcp_pktbuf_tailroom(const tcp_pktbuf_t *pb) {
+    return pb->size - tcp_pktbuf_headroom(pb) - pb->len;
+}
+
+// Extend the contents by n bytes at the end; returns where they go
+static inline uint8_t *tcp_pktbuf_put(tcp_pktbuf_t *pb, uint32_t n) {
+    uint8_t *tail = pb->data + pb->len;
+    pb->len += n;
+    return tail;
+}
+
+// Drop n bytes from the front of the contents without moving the rest
+static inline void tcp_pktbuf_pull(tcp_pktbuf_t *pb, uint32_t n) {
+    pb->data += n;
+    pb->len -= n;
+}
+
+#endif // TCP_PKTBUF_H
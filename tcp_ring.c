@@ -0,0 +1,526 @@
+#include "tcp_ring.h"
+#include "tcp_clock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define RING_ENTRIES_MAX  32768  // Largest submission queue
+#define RING_EVENTS       64     // Readiness events taken per pass
+
+// Fields written by one side sit on a cache line of their own, so the two
+// threads do not pass lines back and forth on every update
+#define RING_LINE __attribute__((aligned(64)))
+
+// An operation taken off the submission queue. It completes at once if it
+// can; otherwise it is parked on its socket until the socket is ready.
+struct ring_op {
+    tcp_sqe_t sqe;
+    uint32_t done;                    // Bytes of a send queued so far
+    struct ring_op *next;             // Next parked on the socket, or free
+};
+
+// Operations parked on one socket, in submission order per direction
+struct ring_wait {
+    struct ring_op *in_head;          // TCP_OP_RECV and TCP_OP_ACCEPT
+    struct ring_op *in_tail;
+    struct ring_op *out_head;         // TCP_OP_SEND, TCP_OP_CONNECT and TCP_OP_CLOSE
+    struct ring_op *out_tail;
+    uint32_t events;                  // Registered with the ring's tcp_epoll instance
+};
+
+struct tcp_ring {
+    // Fixed at creation
+    tcp_sqe_t *sqes;
+    tcp_cqe_t *cqes;
+    uint32_t sq_entries;
+    uint32_t cq_entries;              // Twice sq_entries
+    int cq_fd;                        // eventfd the application sleeps on
+    tcp_stack_t *stack;
+    
+    // Written by the application thread
+    uint32_t sq_tail RING_LINE;       // Submissions published
+    uint32_t sq_local;                // Entries handed out by tcp_ring_get_sqe()
+    uint32_t cq_head;                 // Completions consumed
+    int cq_waiting;                   // Sleeping on cq_fd
+    
+    // Written by the stack thread
+    uint32_t sq_head RING_LINE;       // Submissions taken
+    uint32_t cq_tail;                 // Completions published
+    int sq_blocked;                   // Submissions wait for completion queue room
+    
+    // Stack thread only
+    uint32_t cq_local;                // Completions posted, published as cq_tail
+    struct ring_op *ops;              // cq_entries operations
+    struct ring_op *op_free;
+    uint32_t parked;                  // Operations waiting on a socket
+    struct ring_wait *waits;          // By descriptor index, grown on demand
+    int waits_size;
+    int epfd;
+    tcp_ring_t *next;                 // Next ring of the stack
+};
+
+// ---------------------------------------------------------------------------
+// Stack thread
+// ---------------------------------------------------------------------------
+
+static void ring_complete(tcp_ring_t *ring, struct ring_op *op, int64_t res) {
+    tcp_cqe_t *cqe = &ring->cqes[ring->cq_local++ & (ring->cq_entries - 1)];
+    cqe->user_data = op->sqe.user_data;
+    cqe->res = res;
+    op->next = ring->op_free;
+    ring->op_free = op;
+}
+
+// Parking record of a socket of this stack; NULL with errno set if fd is
+// not one
+static struct ring_wait *ring_wait_for(tcp_ring_t *ring, int fd) {
+    if (fd < 0 || TCP_FD_STACK(fd) != ring->stack->id) {
+        errno = EBADF;
+        return NULL;
+    }
+    
+    int i = TCP_FD_INDEX(fd);
+    if (i >= ring->waits_size) {
+        int size = ring->waits_size ? ring->waits_size : 64;
+        while (size <= i) {
+            size *= 2;
+        }
+        struct ring_wait *waits = realloc(ring->waits, size * sizeof(struct ring_wait));
+        if (waits == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(waits + ring->waits_size, 0, (size - ring->waits_size) * sizeof(struct ring_wait));
+        ring->waits = waits;
+        ring->waits_size = size;
+    }
+    return &ring->waits[i];
+}
+
+static void ring_park(tcp_ring_t *ring, struct ring_op **head, struct ring_op **tail, struct ring_op *op) {
+    op->next = NULL;
+    if (*tail) {
+        (*tail)->next = op;
+    } else {
+        *head = op;
+    }
+    *tail = op;
+    ring->parked++;
+}
+
+static struct ring_op *ring_unpark(tcp_ring_t *ring, struct ring_op **head, struct ring_op **tail) {
+    struct ring_op *op = *head;
+    *head = op->next;
+    if (*head == NULL) {
+        *tail = NULL;
+    }
+    ring->parked--;
+    return op;
+}
+
+// A closed socket takes its pending receives and accepts with it
+static void ring_cancel_in(tcp_ring_t *ring, struct ring_wait *w) {
+    while (w->in_head) {
+        ring_complete(ring, ring_unpark(ring, &w->in_head, &w->in_tail), -ECANCELED);
+    }
+}
+
+// Stop watching a socket that is about to be closed
+static void ring_unwatch(tcp_ring_t *ring, int fd, struct ring_wait *w) {
+    if (w->events) {
+        tcp_epoll_ctl(ring->epfd, TCP_EPOLL_CTL_DEL, fd, NULL);
+        w->events = 0;
+    }
+}
+
+// Carry out an operation without blocking. Sends and receives do not poll
+// the stack either: tcp_ring_poll() does that once per pass, and the
+// segments queued here leave with it. Returns 1 with its result in *res
+// once it is complete, 0 if it has to wait for events on its socket.
+static int ring_try(tcp_ring_t *ring, struct ring_wait *w, struct ring_op *op,
+                    uint32_t events, int64_t *res) {
+    tcp_sqe_t *sqe = &op->sqe;
+    ssize_t n;
+    
+    switch (sqe->op) {
+    case TCP_OP_SEND:
+        n = tcp_stack_send(sqe->fd, (uint8_t *)sqe->buf + op->done, sqe->len - op->done,
+                           sqe->flags);
+        if (n >= 0) {
+            op->done += n;
+            if (op->done < sqe->len) {
+                return 0;
+            }
+            *res = op->done;
+        } else if (errno == EAGAIN) {
+            return 0;
+        } else {
+            *res = op->done > 0 ? (int64_t)op->done : -errno;
+        }
+        return 1;
+        
+    case TCP_OP_RECV:
+        n = tcp_stack_recv(sqe->fd, sqe->buf, sqe->len, sqe->flags);
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        *res = n < 0 ? -errno : n;
+        return 1;
+        
+    case TCP_OP_ACCEPT: {
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        tcp_fcntl(sqe->fd, F_SETFL, O_NONBLOCK);
+        int fd = tcp_accept(sqe->fd, (struct sockaddr *)&peer, &peer_len);
+        if (fd < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        if (fd >= 0) {
+            tcp_fcntl(fd, F_SETFL, O_NONBLOCK);
+            if (sqe->buf && sqe->len >= sizeof(peer)) {
+                memcpy(sqe->buf, &peer, sizeof(peer));
+            }
+        }
+        *res = fd < 0 ? -errno : fd;
+        return 1;
+    }
+        
+    case TCP_OP_CONNECT: {
+        // Established once the socket is writable; errors come with SO_ERROR
+        if (!(events & (TCP_EPOLLOUT | TCP_EPOLLERR | TCP_EPOLLHUP))) {
+            return 0;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        tcp_getsockopt(sqe->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err == 0 && !(events & TCP_EPOLLOUT)) {
+            err = ECONNREFUSED;
+        }
+        if (err) {
+            ring_unwatch(ring, sqe->fd, w);
+            tcp_close(sqe->fd);
+            *res = -err;
+        } else {
+            *res = sqe->fd;
+        }
+        return 1;
+    }
+        
+    case TCP_OP_CLOSE:
+        ring_cancel_in(ring, w);
+        ring_unwatch(ring, sqe->fd, w);
+        tcp_fcntl(sqe->fd, F_SETFL, O_NONBLOCK);
+        *res = tcp_close(sqe->fd) < 0 ? -errno : 0;
+        return 1;
+    }
+    
+    *res = -EINVAL;
+    return 1;
+}
+
+// Watch a socket for the directions it has operations parked in. If it
+// cannot be watched, those operations fail.
+static void ring_watch(tcp_ring_t *ring, int fd, struct ring_wait *w) {
+    uint32_t events = (w->in_head ? TCP_EPOLLIN : 0) | (w->out_head ? TCP_EPOLLOUT : 0);
+    if (events == w->events) {
+        return;
+    }
+    
+    tcp_epoll_event_t ev = { .events = events, .data = (uint64_t)fd };
+    int op = w->events == 0 ? TCP_EPOLL_CTL_ADD : events ? TCP_EPOLL_CTL_MOD : TCP_EPOLL_CTL_DEL;
+    if (tcp_epoll_ctl(ring->epfd, op, fd, &ev) == 0) {
+        w->events = events;
+        return;
+    }
+    
+    int64_t res = -errno;
+    while (w->in_head) {
+        ring_complete(ring, ring_unpark(ring, &w->in_head, &w->in_tail), res);
+    }
+    while (w->out_head) {
+        ring_complete(ring, ring_unpark(ring, &w->out_head, &w->out_tail), res);
+    }
+    w->events = 0;
+}
+
+// A watched socket is ready: run its parked operations in order, up to
+// the first one that still has to wait
+static void ring_ready(tcp_ring_t *ring, int fd, uint32_t events) {
+    struct ring_wait *w = &ring->waits[TCP_FD_INDEX(fd)];
+    int64_t res;
+    
+    while (w->in_head && ring_try(ring, w, w->in_head, events, &res)) {
+        ring_complete(ring, ring_unpark(ring, &w->in_head, &w->in_tail), res);
+    }
+    while (w->out_head && ring_try(ring, w, w->out_head, events, &res)) {
+        ring_complete(ring, ring_unpark(ring, &w->out_head, &w->out_tail), res);
+    }
+    ring_watch(ring, fd, w);
+}
+
+// Start an operation taken off the submission queue
+static void ring_start(tcp_ring_t *ring, struct ring_op *op) {
+    tcp_sqe_t *sqe = &op->sqe;
+    int64_t res;
+    
+    op->done = 0;
+    if (sqe->op < TCP_OP_SEND || sqe->op > TCP_OP_CONNECT) {
+        ring_complete(ring, op, -EINVAL);
+        return;
+    }
+    
+    // A connection is opened here so that its socket belongs to this thread
+    if (sqe->op == TCP_OP_CONNECT) {
+        sqe->fd = tcp_stack_socket(ring->stack);
+        if (sqe->fd < 0) {
+            ring_complete(ring, op, -errno);
+            return;
+        }
+        tcp_fcntl(sqe->fd, F_SETFL, O_NONBLOCK);
+        if (tcp_connect(sqe->fd, (struct sockaddr *)&sqe->addr, sizeof(sqe->addr)) < 0 &&
+            errno != EINPROGRESS) {
+            res = -errno;
+            tcp_close(sqe->fd);
+            ring_complete(ring, op, res);
+            return;
+        }
+    }
+    
+    struct ring_wait *w = ring_wait_for(ring, sqe->fd);
+    if (w == NULL) {
+        ring_complete(ring, op, -errno);
+        return;
+    }
+    
+    // Operations queue up behind earlier ones in the same direction
+    int in = sqe->op == TCP_OP_RECV || sqe->op == TCP_OP_ACCEPT;
+    if (in ? w->in_head == NULL : w->out_head == NULL) {
+        if (ring_try(ring, w, op, 0, &res)) {
+            ring_complete(ring, op, res);
+            return;
+        }
+    }
+    if (in) {
+        ring_park(ring, &w->in_head, &w->in_tail, op);
+    } else {
+        ring_park(ring, &w->out_head, &w->out_tail, op);
+    }
+    ring_watch(ring, sqe->fd, w);
+}
+
+// Submissions the stack thread could take now
+static int ring_has_work(tcp_ring_t *ring) {
+    uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_SEQ_CST);
+    uint32_t used = ring->cq_local - __atomic_load_n(&ring->cq_head, __ATOMIC_SEQ_CST);
+    return tail != ring->sq_head && used + ring->parked < ring->cq_entries;
+}
+
+// One pass over a ring: run operations whose sockets became ready, take
+// new submissions and publish the completions. Returns 1 if work is left.
+static int ring_serve(tcp_ring_t *ring) {
+    tcp_epoll_event_t events[RING_EVENTS];
+    int ready = ring->parked ? tcp_epoll_wait(ring->epfd, events, RING_EVENTS, 0) : 0;
+    for (int i = 0; i < ready; i++) {
+        ring_ready(ring, (int)events[i].data, events[i].events);
+    }
+    
+    // Every operation taken must find room for its completion, so the
+    // completion queue can never overflow
+    uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t head = ring->sq_head;
+    uint32_t used = ring->cq_local - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+    while (head != tail && used + ring->parked < ring->cq_entries) {
+        struct ring_op *op = ring->op_free;
+        ring->op_free = op->next;
+        op->sqe = ring->sqes[head++ & (ring->sq_entries - 1)];
+        ring_start(ring, op);
+        used = ring->cq_local - __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->sq_blocked, head != tail, __ATOMIC_RELAXED);
+    
+    // Publish the batch, then wake the application if it sleeps on it
+    if (ring->cq_local != ring->cq_tail) {
+        __atomic_store_n(&ring->cq_tail, ring->cq_local, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->cq_waiting, __ATOMIC_RELAXED)) {
+            eventfd_write(ring->cq_fd, 1);
+        }
+    }
+    
+    return ready == RING_EVENTS;
+}
+
+int tcp_ring_poll(tcp_stack_t *stack, int timeout_ms) {
+    int busy = 0;
+    for (tcp_ring_t *ring = stack->rings; ring; ring = ring->next) {
+        busy |= ring_serve(ring);
+    }
+    
+    // Announce the sleep, then look at the queues once more: a submission
+    // published before the announcement is seen here, one published after
+    // it signals wake_fd
+    __atomic_store_n(&stack->wake_idle, 1, __ATOMIC_SEQ_CST);
+    for (tcp_ring_t *ring = stack->rings; ring && !busy; ring = ring->next) {
+        busy = ring_has_work(ring);
+    }
+    if (busy) {
+        timeout_ms = 0;
+    }
+    
+    int ret = tcp_stack_poll(stack, timeout_ms);
+    
+    __atomic_store_n(&stack->wake_idle, 0, __ATOMIC_RELAXED);
+    if (timeout_ms != 0 && stack->wake_fd >= 0) {
+        eventfd_t ticks;
+        eventfd_read(stack->wake_fd, &ticks);
+    }
+    return ret;
+}
+
+tcp_ring_t *tcp_ring_create(tcp_stack_t *stack, unsigned entries) {
+    if (entries == 0 || entries > RING_ENTRIES_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t sq_entries = 1;
+    while (sq_entries < entries) {
+        sq_entries *= 2;
+    }
+    
+    if (stack->wake_fd < 0 && (stack->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    
+    void *mem;
+    if (posix_memalign(&mem, 64, sizeof(tcp_ring_t)) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    tcp_ring_t *ring = mem;
+    memset(ring, 0, sizeof(tcp_ring_t));
+    ring->stack = stack;
+    ring->sq_entries = sq_entries;
+    ring->cq_entries = 2 * sq_entries;
+    ring->sqes = calloc(ring->sq_entries, sizeof(tcp_sqe_t));
+    ring->cqes = calloc(ring->cq_entries, sizeof(tcp_cqe_t));
+    ring->ops = calloc(ring->cq_entries, sizeof(struct ring_op));
+    ring->cq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ring->epfd = tcp_stack_epoll_create(stack);
+    if (!ring->sqes || !ring->cqes || !ring->ops || ring->cq_fd < 0 || ring->epfd < 0) {
+        int err = ring->cq_fd < 0 || ring->epfd < 0 ? errno : ENOMEM;
+        if (ring->cq_fd >= 0) {
+            close(ring->cq_fd);
+        }
+        if (ring->epfd >= 0) {
+            tcp_epoll_close(ring->epfd);
+        }
+        free(ring->sqes);
+        free(ring->cqes);
+        free(ring->ops);
+        free(ring);
+        errno = err;
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < ring->cq_entries; i++) {
+        ring->ops[i].next = ring->op_free;
+        ring->op_free = &ring->ops[i];
+    }
+    ring->next = stack->rings;
+    stack->rings = ring;
+    return ring;
+}
+
+// Stack thread, once the application is done with the ring: operations
+// still parked are dropped without a completion
+void tcp_ring_destroy(tcp_ring_t *ring) {
+    tcp_ring_t **link = &ring->stack->rings;
+    while (*link != ring) {
+        link = &(*link)->next;
+    }
+    *link = ring->next;
+    
+    tcp_epoll_close(ring->epfd);
+    close(ring->cq_fd);
+    free(ring->waits);
+    free(ring->sqes);
+    free(ring->cqes);
+    free(ring->ops);
+    free(ring);
+}
+
+// ---------------------------------------------------------------------------
+// Application thread
+// ---------------------------------------------------------------------------
+
+tcp_sqe_t *tcp_ring_get_sqe(tcp_ring_t *ring) {
+    uint32_t head = __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local - head == ring->sq_entries) {
+        return NULL;
+    }
+    
+    tcp_sqe_t *sqe = &ring->sqes[ring->sq_local++ & (ring->sq_entries - 1)];
+    memset(sqe, 0, sizeof(tcp_sqe_t));
+    return sqe;
+}
+
+// Publish the entries filled since the last call and wake the stack
+// thread if it is about to sleep. Returns the number published.
+int tcp_ring_submit(tcp_ring_t *ring) {
+    int count = ring->sq_local - ring->sq_tail;
+    if (count == 0) {
+        return 0;
+    }
+    
+    __atomic_store_n(&ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->stack->wake_idle, __ATOMIC_RELAXED)) {
+        eventfd_write(ring->stack->wake_fd, 1);
+    }
+    return count;
+}
+
+// Copy up to max completions to cqes, waiting up to timeout_ms (-1 =
+// forever) for the first. Returns the number copied.
+int tcp_ring_reap(tcp_ring_t *ring, tcp_cqe_t *cqes, int max, int timeout_ms) {
+    uint64_t deadline = timeout_ms >= 0 ? tcp_now_ms() + timeout_ms : UINT64_MAX;
+    
+    while (1) {
+        uint32_t tail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+        int count = 0;
+        while (count < max && ring->cq_head + count != tail) {
+            cqes[count] = ring->cqes[(ring->cq_head + count) & (ring->cq_entries - 1)];
+            count++;
+        }
+        
+        if (count > 0) {
+            // Room in the completion queue may let held-back submissions in
+            __atomic_store_n(&ring->cq_head, ring->cq_head + count, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->sq_blocked, __ATOMIC_RELAXED) &&
+                __atomic_load_n(&ring->stack->wake_idle, __ATOMIC_SEQ_CST)) {
+                eventfd_write(ring->stack->wake_fd, 1);
+            }
+            return count;
+        }
+        
+        uint64_t now = tcp_now_ms();
+        if (max <= 0 || now >= deadline) {
+            return 0;
+        }
+        
+        // Announce the sleep, then check once more before taking it
+        __atomic_store_n(&ring->cq_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->cq_tail, __ATOMIC_SEQ_CST) == ring->cq_head) {
+            struct pollfd pfd = { .fd = ring->cq_fd, .events = POLLIN };
+            poll(&pfd, 1, deadline == UINT64_MAX ? -1 : (int)(deadline - now));
+            eventfd_t ticks;
+            eventfd_read(ring->cq_fd, &ticks);
+        }
+        __atomic_store_n(&ring->cq_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
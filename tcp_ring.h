@@ -0,0 +1,55 @@
+#ifndef TCP_RING_H
+#define TCP_RING_H
+
+#include "tcp_lite.h"
+
+// Submission/completion rings between an application thread and the thread
+// driving a stack, in the manner of io_uring. The application posts
+// operations on the submission queue; the stack thread carries them out
+// with non-blocking calls and posts one completion per operation. Each
+// queue has one producer and one consumer, so neither side takes a lock.
+
+// Operations
+#define TCP_OP_SEND     1  // Queue len bytes from buf; res = bytes (all of them unless an error cut it short)
+#define TCP_OP_RECV     2  // Read up to len bytes into buf; res = bytes, 0 at EOF
+#define TCP_OP_CLOSE    3  // Close fd once its earlier sends are queued; res = 0
+#define TCP_OP_ACCEPT   4  // Accept on listener fd; res = new descriptor. The peer's
+                           // address goes to buf if len holds a struct sockaddr_in
+#define TCP_OP_CONNECT  5  // Open a socket and connect it to addr; res = new descriptor
+
+typedef struct tcp_sqe {
+    int op;                           // TCP_OP_*
+    int fd;                           // Socket the operation applies to
+    void *buf;                        // Data (owned by the stack thread until completion)
+    uint32_t len;
+    int flags;                        // MSG_* for TCP_OP_SEND and TCP_OP_RECV
+    struct sockaddr_in addr;          // Peer for TCP_OP_CONNECT
+    uint64_t user_data;               // Returned with the completion
+} tcp_sqe_t;
+
+typedef struct tcp_cqe {
+    uint64_t user_data;               // From the submission
+    int64_t res;                      // Result as listed above, or -errno
+} tcp_cqe_t;
+
+typedef struct tcp_ring tcp_ring_t;
+
+// Stack thread (or before it starts): attach a ring with room for entries
+// submissions (rounded up to a power of two) to a stack. Sockets the ring
+// operates on are switched to non-blocking mode and watched through a
+// tcp_epoll instance of the ring's own.
+tcp_ring_t *tcp_ring_create(tcp_stack_t *stack, unsigned entries);
+void tcp_ring_destroy(tcp_ring_t *ring);
+
+// Stack thread: serve the stack's rings and drive the stack for up to
+// timeout_ms, waking early when a ring gets submissions
+int tcp_ring_poll(tcp_stack_t *stack, int timeout_ms);
+
+// Application thread: fill entries from tcp_ring_get_sqe() (NULL when the
+// queue is full), publish them all with tcp_ring_submit(), then collect
+// completions with tcp_ring_reap(), waiting up to timeout_ms for the first
+tcp_sqe_t *tcp_ring_get_sqe(tcp_ring_t *ring);
+int tcp_ring_submit(tcp_ring_t *ring);
+int tcp_ring_reap(tcp_ring_t *ring, tcp_cqe_t *cqes, int max, int timeout_ms);
+
+#endif // TCP_RING_H
@@ -0,0 +1,314 @@
+// Protocol checks over a memory link, for behaviour that needs a peer
+// misbehaving in ways the stack itself never does. The test writes those
+// segments onto the link by hand:
+//   - resets: a refused connect, a reset that wakes a blocked tcp_recv(),
+//     a reset outside the window being ignored, and a reset dropping a
+//     connection a listener has not handed out yet
+//   - handshake: a SYN-ACK with a tiny MSS option still leaves room for data
+//   - window: an ACK overtaken by a later one does not set the send window
+// Exits non-zero on any failure.
+//
+// Usage: ./tcp_test
+
+#include "tcp_lite.h"
+#include "tcp_backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#define ADDR_A "10.1.0.1"
+#define ADDR_B "10.1.0.2"
+
+static int failures;
+
+// Headers of the last segment stack A sent, so the test can aim its resets,
+// and the largest payload it has sent
+static tcp_backend_ops_t tap_backend;
+static struct ip_header last_ip;
+static struct tcp_header last_tcp;
+static int max_payload;
+
+// Window the hand-made segments advertise
+static uint16_t put_window = 65535;
+
+static void tap_xmit(tcp_stack_t *stack, const tcp_pkt_t *pkts, int n) {
+    for (int i = 0; i < n; i++) {
+        const uint8_t *hdr = pkts[i].iov[0].iov_base;
+        memcpy(&last_ip, hdr, sizeof(last_ip));
+        memcpy(&last_tcp, hdr + sizeof(last_ip), sizeof(last_tcp));
+        int payload = ntohs(last_ip.total_length) - sizeof(last_ip) - (last_tcp.data_offset >> 4) * 4;
+        if (payload > max_payload) {
+            max_payload = payload;
+        }
+    }
+    tcp_backend_mem.xmit(stack, pkts, n);
+}
+
+static void check(int ok, const char *what) {
+    printf("  %-52s %s\n", what, ok ? "ok" : "FAIL");
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Put a segment with the given options (a multiple of 4 bytes) and no
+// payload on from's side of the link, as if its stack had sent it
+static void put_segment_opts(tcp_stack_t *from, uint32_t saddr, uint32_t daddr,
+                             uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags,
+                             const uint8_t *opts, size_t opt_len) {
+    uint8_t pkt[sizeof(struct ip_header) + sizeof(struct tcp_header) + 40];
+    size_t tcp_len = sizeof(struct tcp_header) + opt_len;
+    struct ip_header *iph = (struct ip_header *)pkt;
+    struct tcp_header *tcph = (struct tcp_header *)(pkt + sizeof(*iph));
+    
+    memset(pkt, 0, sizeof(pkt));
+    iph->version_ihl = 0x45;
+    iph->total_length = htons(sizeof(*iph) + tcp_len);
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_TCP;
+    iph->src_addr = saddr;
+    iph->dst_addr = daddr;
+    iph->checksum = ip_checksum(iph, sizeof(*iph));
+    
+    tcph->src_port = sport;
+    tcph->dst_port = dport;
+    tcph->seq_num = htonl(seq);
+    tcph->ack_num = htonl(ack);
+    tcph->data_offset = (tcp_len / 4) << 4;
+    tcph->flags = flags;
+    tcph->window = htons(put_window);
+    memcpy(tcph + 1, opts, opt_len);
+    
+    uint8_t sum[sizeof(struct pseudo_header) + sizeof(struct tcp_header) + 40];
+    struct pseudo_header *ph = (struct pseudo_header *)sum;
+    ph->src_addr = saddr;
+    ph->dst_addr = daddr;
+    ph->zero = 0;
+    ph->protocol = IPPROTO_TCP;
+    ph->tcp_length = htons(tcp_len);
+    memcpy(sum + sizeof(*ph), tcph, tcp_len);
+    tcph->checksum = tcp_checksum(sum, sizeof(*ph) + tcp_len);
+    
+    tcp_pkt_t out;
+    memset(&out, 0, sizeof(out));
+    out.iov[0].iov_base = pkt;
+    out.iov[0].iov_len = sizeof(*iph) + tcp_len;
+    out.iovcnt = 1;
+    out.dst_addr = daddr;
+    tcp_backend_mem.xmit(from, &out, 1);
+}
+
+static void put_segment(tcp_stack_t *from, uint32_t saddr, uint32_t daddr,
+                        uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags) {
+    put_segment_opts(from, saddr, daddr, sport, dport, seq, ack, flags, NULL, 0);
+}
+
+// Reset the connection of A's last segment from B's side
+static void put_reset(tcp_stack_t *b, uint32_t seq, uint32_t ack, uint8_t flags) {
+    put_segment(b, last_ip.dst_addr, last_ip.src_addr, last_tcp.dst_port, last_tcp.src_port,
+                seq, ack, TCP_RST | flags);
+}
+
+static int pending_error(int sockfd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    tcp_getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+    return err;
+}
+
+static int conn_state(int sockfd) {
+    tcp_conn_info_t info;
+    tcp_getinfo(sockfd, &info);
+    return info.state;
+}
+
+// Connect to a port nobody listens on and refuse it
+static void test_refused(tcp_stack_t *a, tcp_stack_t *b) {
+    printf("Refused connect:\n");
+    
+    int cs = tcp_stack_socket(a);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(81) };
+    addr.sin_addr.s_addr = inet_addr(ADDR_B);
+    tcp_fcntl(cs, F_SETFL, O_NONBLOCK);
+    check(tcp_connect(cs, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno == EINPROGRESS,
+          "connect in progress");
+    uint32_t isn = ntohl(last_tcp.seq_num);
+    
+    put_reset(b, 0, isn, TCP_ACK);
+    tcp_stack_poll(a, 10);
+    check(conn_state(cs) == TCP_SYN_SENT, "reset not acknowledging the SYN ignored");
+    
+    put_reset(b, 0, isn + 1, TCP_ACK);
+    tcp_stack_poll(a, 10);
+    check(conn_state(cs) == TCP_CLOSED, "reset acknowledging the SYN closes");
+    check(pending_error(cs) == ECONNREFUSED, "error is ECONNREFUSED");
+    tcp_close(cs);
+}
+
+// Reset an established connection while tcp_recv() waits on it
+static void test_reset_recv(tcp_stack_t *a, tcp_stack_t *b) {
+    printf("Reset during recv:\n");
+    
+    int ls = tcp_stack_socket(b);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(80) };
+    tcp_bind(ls, (struct sockaddr *)&addr, sizeof(addr));
+    tcp_listen(ls, 5);
+    tcp_fcntl(ls, F_SETFL, O_NONBLOCK);
+    
+    int cs = tcp_stack_socket(a);
+    addr.sin_addr.s_addr = inet_addr(ADDR_B);
+    check(tcp_connect(cs, (struct sockaddr *)&addr, sizeof(addr)) == 0, "connected");
+    int ss = tcp_accept(ls, NULL, NULL);
+    check(ss >= 0, "accepted");
+    uint32_t rcv_nxt = ntohl(last_tcp.ack_num);
+    uint32_t snd_nxt = ntohl(last_tcp.seq_num);
+    
+    put_reset(b, rcv_nxt + 0x40000000, 0, 0);
+    tcp_stack_poll(a, 10);
+    check(conn_state(cs) == TCP_ESTABLISHED, "reset outside the window ignored");
+    
+    // The reset lands while tcp_recv() is blocked
+    tcp_netem_t netem = { .delay_us = 50000 };
+    tcp_mem_netem(b, &netem);
+    put_reset(b, rcv_nxt, snd_nxt, TCP_ACK);
+    char buf[64];
+    check(tcp_recv(cs, buf, sizeof(buf), 0) < 0 && errno == ECONNRESET, "blocked recv fails with ECONNRESET");
+    check(conn_state(cs) == TCP_CLOSED, "connection closed");
+    tcp_mem_netem(b, NULL);
+    
+    // B's side is left to finish on its own
+    tcp_fcntl(ss, F_SETFL, O_NONBLOCK);
+    tcp_close(cs);
+    tcp_close(ss);
+    tcp_close(ls);
+}
+
+// Reset a connection still in the listener's SYN queue; a new SYN on the
+// same 4-tuple then starts a connection of its own
+static void test_reset_syn_rcvd(tcp_stack_t *a, tcp_stack_t *b) {
+    printf("Reset in SYN_RCVD:\n");
+    
+    int ls = tcp_stack_socket(b);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(82) };
+    tcp_bind(ls, (struct sockaddr *)&addr, sizeof(addr));
+    tcp_listen(ls, 5);
+    
+    uint32_t saddr = inet_addr(ADDR_A), daddr = inet_addr(ADDR_B);
+    tcp_mib_t before, after;
+    tcp_stack_mib(b, &before);
+    
+    put_segment(a, saddr, daddr, htons(4000), htons(82), 1000, 0, TCP_SYN);
+    tcp_stack_poll(b, 10);
+    put_segment(a, saddr, daddr, htons(4000), htons(82), 1001, 0, TCP_RST);
+    tcp_stack_poll(b, 10);
+    put_segment(a, saddr, daddr, htons(4000), htons(82), 5000, 0, TCP_SYN);
+    tcp_stack_poll(b, 10);
+    
+    tcp_stack_mib(b, &after);
+    check(after.passive_opens - before.passive_opens == 2, "reset child left the SYN queue");
+    tcp_close(ls);
+}
+
+// Answer a connect with a SYN-ACK whose MSS option is smaller than the
+// timestamp option that comes off every segment
+static void test_tiny_mss(tcp_stack_t *a, tcp_stack_t *b) {
+    printf("Tiny MSS:\n");
+    
+    int cs = tcp_stack_socket(a);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(83) };
+    addr.sin_addr.s_addr = inet_addr(ADDR_B);
+    tcp_fcntl(cs, F_SETFL, O_NONBLOCK);
+    tcp_connect(cs, (struct sockaddr *)&addr, sizeof(addr));
+    uint32_t isn = ntohl(last_tcp.seq_num);
+    
+    // MSS 12, then NOP, NOP, timestamps (TSval 1, TSecr 0)
+    static const uint8_t opts[] = { 2, 4, 0, 12, 1, 1, 8, 10, 0, 0, 0, 1, 0, 0, 0, 0 };
+    put_segment_opts(b, last_ip.dst_addr, last_ip.src_addr, last_tcp.dst_port, last_tcp.src_port,
+                     7000, isn + 1, TCP_SYN | TCP_ACK, opts, sizeof(opts));
+    tcp_stack_poll(a, 10);
+    check(conn_state(cs) == TCP_ESTABLISHED, "connected");
+    
+    tcp_conn_info_t info;
+    tcp_getinfo(cs, &info);
+    check(info.mss == TCP_MSS_MIN - 12, "MSS raised to the minimum");  // Less the timestamps
+    
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+    max_payload = 0;
+    check(tcp_send(cs, buf, sizeof(buf), 0) == sizeof(buf), "send queued");
+    check(max_payload > 0 && max_payload <= (int)info.mss, "segments carry data within the MSS");
+    tcp_close(cs);
+}
+
+// Send A two ACKs for the same data whose windows arrive in the wrong order;
+// only the one sent later (higher sequence number) may set the window
+static void test_stale_window(tcp_stack_t *a, tcp_stack_t *b) {
+    printf("Stale window update:\n");
+    
+    int cs = tcp_stack_socket(a);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(84) };
+    addr.sin_addr.s_addr = inet_addr(ADDR_B);
+    tcp_fcntl(cs, F_SETFL, O_NONBLOCK);
+    tcp_connect(cs, (struct sockaddr *)&addr, sizeof(addr));
+    uint32_t isn = ntohl(last_tcp.seq_num);
+    uint32_t saddr = last_ip.dst_addr, daddr = last_ip.src_addr;
+    uint16_t sport = last_tcp.dst_port, dport = last_tcp.src_port;
+    
+    put_segment(b, saddr, daddr, sport, dport, 9000, isn + 1, TCP_SYN | TCP_ACK);
+    tcp_stack_poll(a, 10);
+    check(conn_state(cs) == TCP_ESTABLISHED, "connected");
+    
+    tcp_conn_info_t info;
+    put_window = 1000;
+    put_segment(b, saddr, daddr, sport, dport, 9101, isn + 1, TCP_ACK);
+    tcp_stack_poll(a, 10);
+    tcp_getinfo(cs, &info);
+    check(info.snd_wnd == 1000, "later ACK sets the window");
+    
+    put_window = 65535;
+    put_segment(b, saddr, daddr, sport, dport, 9001, isn + 1, TCP_ACK);
+    tcp_stack_poll(a, 10);
+    tcp_getinfo(cs, &info);
+    check(info.snd_wnd == 1000, "earlier ACK arriving late is ignored");
+    
+    put_window = 2000;
+    put_segment(b, saddr, daddr, sport, dport, 9101, isn + 1, TCP_ACK);
+    tcp_stack_poll(a, 10);
+    tcp_getinfo(cs, &info);
+    check(info.snd_wnd == 2000, "ACK with the same sequence number updates it");
+    
+    put_window = 65535;
+    tcp_close(cs);
+}
+
+int main(void) {
+    tcp_stack_config_t config_a = { .backend = &tcp_backend_mem, .addr = inet_addr(ADDR_A) };
+    tcp_stack_config_t config_b = { .backend = &tcp_backend_mem, .addr = inet_addr(ADDR_B) };
+    tcp_stack_t *a = tcp_stack_create(&config_a);
+    tcp_stack_t *b = tcp_stack_create(&config_b);
+    if (a == NULL || b == NULL || tcp_mem_link(a, b) < 0) {
+        perror("memory link");
+        return 1;
+    }
+    
+    // tcp_mem_link() wants the mem backend itself, so the tap goes in after
+    tap_backend = tcp_backend_mem;
+    tap_backend.xmit = tap_xmit;
+    a->backend = &tap_backend;
+    
+    test_refused(a, b);
+    test_reset_recv(a, b);
+    test_reset_syn_rcvd(a, b);
+    test_tiny_mss(a, b);
+    test_stale_window(a, b);
+    
+    a->backend = &tcp_backend_mem;
+    tcp_stack_destroy(a);
+    tcp_stack_destroy(b);
+    
+    printf(failures ? "%d check(s) failed\n" : "All checks passed\n", failures);
+    return failures ? 1 : 0;
+}
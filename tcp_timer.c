@@ -0,0 +1,138 @@
+#include "tcp_timer.h"
+
+// Level n slots each cover 64^n ticks, so the wheel reaches
+// 64^TCP_WHEEL_LEVELS ticks ahead of its clock
+#define WHEEL_MASK        (TCP_WHEEL_SLOTS - 1)
+#define WHEEL_SHIFT(lvl)  ((lvl) * 6)
+#define WHEEL_SPAN(lvl)   ((uint64_t)1 << WHEEL_SHIFT(lvl))
+
+// Put a timer in the slot its expiry falls in, on the lowest level that
+// reaches that far from the wheel's clock
+static void wheel_link(tcp_timer_wheel_t *wheel, tcp_timer_t *timer) {
+    uint64_t expires = timer->expires < wheel->now ? wheel->now : timer->expires;
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    
+    while (level < TCP_WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1)) {
+        level++;
+    }
+    if (delta >= WHEEL_SPAN(TCP_WHEEL_LEVELS)) {
+        // Beyond the top level: park it in the furthest slot, which places
+        // it again when it comes up
+        expires = wheel->now + WHEEL_SPAN(TCP_WHEEL_LEVELS) - 1;
+    }
+    
+    int idx = (expires >> WHEEL_SHIFT(level)) & WHEEL_MASK;
+    tcp_timer_t **head = &wheel->slots[level][idx];
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->slot = level * TCP_WHEEL_SLOTS + idx;
+    wheel->occupied[level] |= (uint64_t)1 << idx;
+}
+
+static void wheel_unlink(tcp_timer_wheel_t *wheel, tcp_timer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+    
+    int level = timer->slot / TCP_WHEEL_SLOTS;
+    int idx = timer->slot & WHEEL_MASK;
+    if (wheel->slots[level][idx] == NULL) {
+        wheel->occupied[level] &= ~((uint64_t)1 << idx);
+    }
+}
+
+// A higher-level slot came up: spread its timers over the levels below
+static void wheel_cascade(tcp_timer_wheel_t *wheel, int level, int idx) {
+    tcp_timer_t *timer = wheel->slots[level][idx];
+    
+    wheel->slots[level][idx] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << idx);
+    while (timer) {
+        tcp_timer_t *next = timer->next;
+        wheel_link(wheel, timer);
+        timer = next;
+    }
+}
+
+void tcp_timer_add(tcp_timer_wheel_t *wheel, tcp_timer_t *timer, uint64_t expires) {
+    if (timer->pprev) {
+        wheel_unlink(wheel, timer);
+    }
+    timer->expires = expires;
+    wheel_link(wheel, timer);
+}
+
+void tcp_timer_del(tcp_timer_wheel_t *wheel, tcp_timer_t *timer) {
+    if (timer->pprev) {
+        wheel_unlink(wheel, timer);
+    }
+}
+
+uint64_t tcp_timer_next(const tcp_timer_wheel_t *wheel) {
+    uint64_t next = 0;
+    
+    for (int level = 0; level < TCP_WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0) {
+            continue;
+        }
+        
+        // Slots of this level are processed on multiples of its span: find
+        // the first occupied one from the next such tick on
+        uint64_t first = (wheel->now + WHEEL_SPAN(level) - 1) >> WHEEL_SHIFT(level);
+        int start = first & WHEEL_MASK;
+        uint64_t rotated = start ? (occupied >> start) | (occupied << (TCP_WHEEL_SLOTS - start))
+                                 : occupied;
+        uint64_t tick = (first + __builtin_ctzll(rotated)) << WHEEL_SHIFT(level);
+        
+        if (next == 0 || tick < next) {
+            next = tick;
+        }
+    }
+    
+    return next;
+}
+
+void tcp_timer_run(tcp_timer_wheel_t *wheel, uint64_t now, void (*expire)(tcp_timer_t *timer)) {
+    // Jump from one tick with work to the next instead of stepping through
+    // every millisecond
+    for (;;) {
+        uint64_t tick = tcp_timer_next(wheel);
+        if (tick == 0 || tick > now) {
+            break;
+        }
+        
+        wheel->now = tick;
+        for (int level = 1; level < TCP_WHEEL_LEVELS && (tick & (WHEEL_SPAN(level) - 1)) == 0; level++) {
+            wheel_cascade(wheel, level, (tick >> WHEEL_SHIFT(level)) & WHEEL_MASK);
+        }
+        
+        // Detach the due slot so timers started by expire land in a later one
+        int idx = tick & WHEEL_MASK;
+        tcp_timer_t *expired = wheel->slots[0][idx];
+        wheel->slots[0][idx] = NULL;
+        wheel->occupied[0] &= ~((uint64_t)1 << idx);
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        wheel->now = tick + 1;
+        
+        // Unlinked one at a time: expire may stop others on the list
+        while (expired) {
+            tcp_timer_t *timer = expired;
+            wheel_unlink(wheel, timer);
+            expire(timer);
+        }
+    }
+    
+    if (wheel->now <= now) {
+        wheel->now = now + 1;
+    }
+}
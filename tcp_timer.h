@@ -0,0 +1,30 @@
+#ifndef TCP_TIMER_H
+#define TCP_TIMER_H
+
+#include "tcp_lite.h"
+#include <stddef.h>
+
+// Hierarchical timer wheel with 1 ms ticks. Starting and stopping a timer
+// is O(1); a timer is touched again only when its slot comes up, once per
+// level it moves down.
+
+// Start a timer to fire at tick expires, or move it there if it is pending
+void tcp_timer_add(tcp_timer_wheel_t *wheel, tcp_timer_t *timer, uint64_t expires);
+
+// Stop a timer; nothing happens if it is not pending
+void tcp_timer_del(tcp_timer_wheel_t *wheel, tcp_timer_t *timer);
+
+// Fire every timer due at or before tick now, calling expire for each.
+// expire may start and stop timers, including the one that fired.
+void tcp_timer_run(tcp_timer_wheel_t *wheel, uint64_t now, void (*expire)(tcp_timer_t *timer));
+
+// Earliest tick the wheel has work for (0 = none pending). Timers far
+// ahead are reported at the tick they move down a level, which is early
+// but never late.
+uint64_t tcp_timer_next(const tcp_timer_wheel_t *wheel);
+
+static inline int tcp_timer_pending(const tcp_timer_t *timer) {
+    return timer->pprev != NULL;
+}
+
+#endif // TCP_TIMER_H